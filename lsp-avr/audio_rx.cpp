@@ -0,0 +1,107 @@
+#include <Arduino.h>
+
+#include "audio_rx.h"
+
+
+// Distance thresholds in micros() units
+#define _RX_GLITCH_CLK AUDIO_RX_CLK(AUDIO_RX_SYM_MIN / 2.0)                          // Edges of the same burst
+#define _RX_NOISE_CLK  AUDIO_RX_CLK(AUDIO_RX_SYM_MIN - AUDIO_RX_SYM_STEP / 2.0)
+#define _RX_SYM_CLK(n) AUDIO_RX_CLK(AUDIO_RX_SYM_MIN + ((n) + 0.5) * AUDIO_RX_SYM_STEP)  // Between symbol n and n + 1
+#define _RX_SYNC_CLK   AUDIO_RX_CLK((AUDIO_RX_SYM_MIN + 3 * AUDIO_RX_SYM_STEP + AUDIO_RX_SYNC) / 2.0)
+
+#define _RX_NO_SYNC 0xff
+
+
+// Received bytes, written by audio_rx_edge only
+static volatile byte           _rx_buf[AUDIO_RX_BUF_LEN];
+static volatile byte           _rx_head, _rx_tail;
+static volatile unsigned short _rx_errors;
+
+// Decoder state
+static unsigned long _rx_last;  // Time of the last edge
+static byte          _rx_byte;
+static byte          _rx_sym;   // Symbols of _rx_byte received, _RX_NO_SYNC while waiting for a sync
+
+
+void audio_rx_init(){
+    _rx_head   = 0;
+    _rx_tail   = 0;
+    _rx_errors = 0;
+
+    _rx_last = 0;
+    _rx_sym  = _RX_NO_SYNC;
+}
+
+void audio_rx_edge(unsigned long t){
+    unsigned long dist = t - _rx_last;
+    byte          sym, next;
+
+    if(dist < _RX_GLITCH_CLK) return;
+    _rx_last = t;
+
+    if(dist >= _RX_SYNC_CLK){
+        if(_rx_sym && _rx_sym != _RX_NO_SYNC) _rx_errors++;
+
+        _rx_sym  = 0;
+        _rx_byte = 0;
+        return;
+    }
+
+    if(_rx_sym == _RX_NO_SYNC) return;
+
+    if(dist < _RX_NOISE_CLK){
+        _rx_errors++;
+        _rx_sym = _RX_NO_SYNC;
+        return;
+    }
+
+    if(dist < _RX_SYM_CLK(0))      sym = 0;
+    else if(dist < _RX_SYM_CLK(1)) sym = 1;
+    else if(dist < _RX_SYM_CLK(2)) sym = 2;
+    else                          sym = 3;
+
+    _rx_byte |= sym << (2 * _rx_sym);
+    if(++_rx_sym < 4) return;
+
+    _rx_sym = _RX_NO_SYNC;
+
+    next = (_rx_head + 1) & (AUDIO_RX_BUF_LEN - 1);
+    if(next == _rx_tail){
+        _rx_errors++;
+        return;
+    }
+
+    _rx_buf[_rx_head] = _rx_byte;
+    _rx_head = next;
+}
+
+int audio_rx_read(){
+    byte c;
+
+    if(_rx_tail == _rx_head) return -1;
+
+    c = _rx_buf[_rx_tail];
+    _rx_tail = (_rx_tail + 1) & (AUDIO_RX_BUF_LEN - 1);
+
+    return c;
+}
+
+bool audio_rx_busy(unsigned long t){
+    unsigned long last;
+
+    noInterrupts();
+    last = _rx_last;
+    interrupts();
+
+    return t - last < AUDIO_RX_CLK(AUDIO_RX_LEAD + AUDIO_RX_SYNC);
+}
+
+unsigned short audio_rx_errors(){
+    unsigned short errors;
+
+    noInterrupts();
+    errors = _rx_errors;
+    interrupts();
+
+    return errors;
+}
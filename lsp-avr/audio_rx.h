@@ -0,0 +1,70 @@
+#ifndef LSP_AUDIO_RX_H
+#define LSP_AUDIO_RX_H 1
+
+/*
+    Audio link receiver (CFG_AUDIO_SERIAL), the demodulator of lsp-ctrl-srv/pulse_bridge.py.
+
+    The line out sends short bursts of carrier, which the ASK filter turns into low
+    pulses on pin 10. The data is in the distance between the bursts (pulse distance
+    modulation), in samples at AUDIO_RX_SAMPLE_RATE:
+        AUDIO_RX_SYM_MIN + n * AUDIO_RX_SYM_STEP   symbol n (0 to 3, 2 bits)
+        AUDIO_RX_SYNC or longer                    start of a byte
+    A byte is a sync followed by 4 symbols, least significant bits first; the silence
+    before a transmission counts as a sync, so it starts with a single burst.
+    Only the distance between the falling edges matters, and the filter delays all of
+    them the same, so the burst length and the filter's attack don't change the symbols.
+
+    The pin change interrupt timestamps the edges and calls audio_rx_edge, which
+    decodes them into a ring buffer: the interrupt takes a few microseconds, instead
+    of blocking the others for a whole byte like SoftwareSerial did. The pin change
+    interrupt is the only one that may preempt the tick (see timer1_isr), as the
+    timestamps need to be taken right away.
+    A distance shorter than symbol 0 (noise) or a sync before the 4th symbol drops
+    the byte, the next sync starts over.
+    Every transmission starts with a lone burst, AUDIO_RX_LEAD samples before the
+    first byte: audio_rx_busy turns true on it, so that whatever keeps the interrupts
+    off for a while (the strip push, see strip.h) waits for the end of the transmission
+    instead of delaying its edges. The lead has to be longer than that while plus a sync
+*/
+
+#include <Arduino.h>
+
+
+// Must match lsp-ctrl-srv/pulse_bridge.py
+#define AUDIO_RX_SAMPLE_RATE 44100
+#define AUDIO_RX_SYM_MIN     16
+#define AUDIO_RX_SYM_STEP    3
+#define AUDIO_RX_SYNC        30
+#define AUDIO_RX_LEAD        100
+
+// The edges are timestamped with micros(), which on the board counts 64 per microsecond:
+// Timer0 runs unprescaled for the PWM (see setup in lsp-avr.ino), and the core scales its
+// count as if it were prescaled by 64
+#define AUDIO_RX_CLK_PER_US 64
+
+// Samples to micros() units, rounded
+#define AUDIO_RX_CLK(samples) ((unsigned long)((samples) * 1000000.0 * AUDIO_RX_CLK_PER_US / AUDIO_RX_SAMPLE_RATE + 0.5))
+
+// Mean samples per byte (the symbols are equally likely)
+#define AUDIO_RX_BYTE_SAMPLES (AUDIO_RX_SYNC + 4 * AUDIO_RX_SYM_MIN + 6 * AUDIO_RX_SYM_STEP)
+
+// Power of 2
+#define AUDIO_RX_BUF_LEN 64
+
+
+void audio_rx_init();
+
+// From the pin change interrupt: a falling edge at t (micros(), see AUDIO_RX_CLK_PER_US)
+void audio_rx_edge(unsigned long t);
+
+// The next received byte, -1 if there is none
+int audio_rx_read();
+
+// True if a transmission may be going on at t (micros()): there was an edge less than a
+// lead and a sync ago
+bool audio_rx_busy(unsigned long t);
+
+// Bytes dropped because of bad distances or a full buffer
+unsigned short audio_rx_errors();
+
+#endif
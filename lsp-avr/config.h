@@ -1,36 +1,130 @@
 // Serial mode
 // 0: in/out via usb, 115200 baud
-// 1: in via audio serial at CFG_AUDIO_BAUDRATE baud, out via usb at 9600 baud
+// 1: in via the audio link (see audio_rx.h, 64 bytes of SRAM for its buffer), out via usb at 9600 baud
 #define CFG_AUDIO_SERIAL   0
-#define CFG_AUDIO_BAUDRATE 2756  // See lsp-ctrl-srv/pulse_bridge.py
 
 // Enable debug messages
 #define CFG_DO_DEBUG 1
 
-// Enable the help in the console (very memory hard)
+// Enable the help in the console (the strings live in flash, but take ~1.3 KB of it)
 #define CFG_ENABLE_HELP 1
 
 // Serial activity LED config
 #define CFG_ALED_PHASE_MS   25   // Duration of a single on/off phase
 #define CFG_ALED_TIMEOUT_MS 100  // Total duration
 
-// How much time it takes to change the brightness
+// How much time it takes to change the brightness, and the curve it follows (ENVELOPE_* in envelope.h).
+// Both can be changed from the console ('f')
 #define CFG_BRIGHTNESS_ADJ_MS 333
+#define CFG_BRIGHTNESS_CURVE  ENVELOPE_PERCEPTUAL
 
+// Output stage (output.h): the PWM level of the oregs comes from a brightness x gamma table
+// (130 bytes of SRAM), rebuilt when the brightness changes
+// 0: linear, the oreg MSB scaled by the brightness MSB
+// 1: gamma 2 curve, finer steps at the low end
+#ifndef CFG_OUT_GAMMA
+    #define CFG_OUT_GAMMA 1
+#endif
 
-// CONFIG END, down below there is some generated stuff
+// Temporal dithering: the fractional part of the PWM levels, low byte of the oregs
+// included, is spread over the ticks, so slow fades don't step at the low end
+#ifndef CFG_OUT_DITHER
+    #define CFG_OUT_DITHER 1
+#endif
 
-#if CFG_AUDIO_SERIAL
-    #include <SoftwareSerial.h>
+// Addressable strip (strip.h): a frame buffer of this many WS2812 pixels (at most 32, 3 bytes
+// of SRAM each) on pin 7, changed by the pixel operations of the VM and pushed by cmt.
+// 0 disables it, and the link rejects the programs which use the pixel operations.
+// A push keeps the interrupts off for 30 us per pixel, so it waits while the serial is
+// receiving: over the audio link lsp-ctrl-srv starts every transmission with a lone burst
+// for that (AUDIO_RX_LEAD). Over USB a command starting during a push loses its first bytes
+// past the two the UART holds (87 us each at 115200), so only up to 8 pixels go with it
+#ifndef CFG_STRIP_PIXELS
+    #define CFG_STRIP_PIXELS 0
+#endif
+
+#if defined(__AVR__) && !CFG_AUDIO_SERIAL && CFG_STRIP_PIXELS > 8
+    #error "CFG_STRIP_PIXELS is at most 8 with the serial over USB, use CFG_AUDIO_SERIAL for more"
+#endif
 
-    extern SoftwareSerial AudioSerial;
+// A command which stops arriving for this long in the middle is ended (see the console parser in lsp-avr.ino)
+#define CFG_CONSOLE_TIMEOUT_MS 250
+
+// Collect timer1_isr timing statistics (console commands 'S' and 'Z')
+#define CFG_ISR_STATS 1
+
+// Max instructions the VM executes in a single tick (0: unlimited). When a program
+// runs out of it, it is preempted and resumes where it left on the next tick
+#define CFG_VM_TICK_BUDGET 200
+
+// VM execution engine
+// 0: classic interpreter, decodes the bytecode in lsp_imem one instruction at a time
+// 1: predecoded engine, the program is translated at link time to CFG_VM_PDEC_LEN (max 255)
+//    4-byte entries and run with threaded dispatch. Programs with more instructions
+//    than that run on the classic interpreter. The entries take 384 bytes of SRAM, and the
+//    translation another 128 bytes of stack inside timer1_isr at every 'P': it doesn't fit
+//    with CFG_IMEM_DOUBLE_BUFFER (see the SRAM check at the end)
+#ifndef CFG_VM_ENGINE
+    #define CFG_VM_ENGINE 0
+#endif
+#define CFG_VM_PDEC_LEN 96
+
+// Compressed programs: lsp_imem holds an image compressed by lspc -z (see lspvm-asm/lspc_z.py),
+// which the classic interpreter decodes a block at a time into a small cache as it fetches.
+// The bytecode can then be up to VM_Z_MAX_LEN bytes long (while the image still has to fit
+// in MAX_PROG_LEN), and the uploads and the EEPROM slots get shorter. Costs about 130 bytes
+// of SRAM for the cache, and the decoding of a block (some hundreds of cycles) every time the
+// program jumps to one that isn't cached. The link also needs about 200 bytes of stack (the
+// bitmap of the instruction boundaries grows to 128 bytes, plus a block). Only with CFG_VM_ENGINE 0
+#ifndef CFG_VM_COMPRESSED
+    #define CFG_VM_COMPRESSED 0
+#endif
 
-    #define IN_SERIAL  AudioSerial
+// Built-in programs ('B<n>' command): programs translated ahead of time to C++ by lspvm-asm/lspaot,
+// which run without imem and without decoding. Enable them after generating builtins.h:
+//   lspaot lsp-avr/builtins.h <pgm.lspb>...
+#ifndef CFG_VM_BUILTINS
+    #define CFG_VM_BUILTINS 0
+#endif
+
+// What happens to an interrupt request while the VM is busy with another one, per vector:
+//   VM_IRQ_QUEUE     run it after the others
+//   VM_IRQ_COALESCE  like VM_IRQ_QUEUE, but a request still waiting in the queue gets the new argument
+//   VM_IRQ_DROP      discard it
+#define CFG_VM_IRQ_POLICY_0 VM_IRQ_QUEUE
+#define CFG_VM_IRQ_POLICY_1 VM_IRQ_QUEUE
+#define CFG_VM_IRQ_POLICY_2 VM_IRQ_COALESCE
+#define CFG_VM_IRQ_POLICY_3 VM_IRQ_DROP
+
+// Keep two program buffers: the console loads a program in one while the VM runs the
+// other, and 'P' swaps them on a tick boundary without pausing the outputs.
+// Costs another MAX_PROG_LEN + 1 (513) bytes of SRAM
+#define CFG_IMEM_DOUBLE_BUFFER 1
+
+// Number of program slots in the EEPROM (see slots.h), 0 to disable them.
+// The EEPROM is split evenly: with 4 slots a program can be up to 248 bytes long
+#define CFG_EEPROM_SLOTS 4
+
+
+// CONFIG END, down below there is some generated stuff
+
+#if CFG_AUDIO_SERIAL
+    #define IN_SERIAL_READ() audio_rx_read()
 #else
-    #define IN_SERIAL  Serial
+    #define IN_SERIAL_READ() Serial.read()
 #endif
 
 #define OUT_SERIAL Serial
 
+// Static SRAM of the options above, roughly: 1060 bytes are always there (a program buffer 513,
+// vm_state_t 241, the output table 148, the HardwareSerial buffers 157). The 2 KB of the
+// ATmega328P must keep at least 256 bytes for the stack, which timer1_isr uses for the link
+#define _CFG_SRAM_STATIC (1060 + CFG_IMEM_DOUBLE_BUFFER * 513 + (CFG_VM_ENGINE == 1) * CFG_VM_PDEC_LEN * 4 + \
+                          CFG_VM_COMPRESSED * 130 + CFG_AUDIO_SERIAL * 64 + CFG_STRIP_PIXELS * 3)
+
+#if defined(__AVR__) && _CFG_SRAM_STATIC > 2048 - 256
+    #error "the options don't fit in the SRAM, see their costs (CFG_VM_ENGINE 1 doesn't go with CFG_IMEM_DOUBLE_BUFFER)"
+#endif
+
 #define PR(args...)  OUT_SERIAL.print(args)
 #define PLN(args...) OUT_SERIAL.println(args);
@@ -0,0 +1,78 @@
+#include <Arduino.h>
+#include <avr/pgmspace.h>
+
+#include "envelope.h"
+#include "config.h"
+
+
+// Progress (Q0.16) at phase i / ENVELOPE_CURVE_LEN
+static const unsigned short _envelope_curves[ENVELOPE_CURVES][ENVELOPE_CURVE_LEN + 1] PROGMEM = {
+    // ENVELOPE_LINEAR
+    {0, 4096, 8192, 12288, 16384, 20480, 24576, 28672, 32768, 36864, 40960, 45056, 49152, 53248, 57344, 61440, 65535},
+    // ENVELOPE_EASE: 3t^2 - 2t^3
+    {0, 736, 2816, 6048, 10240, 15200, 20736, 26656, 32768, 38880, 44800, 50336, 55296, 59488, 62720, 64800, 65535},
+    // ENVELOPE_PERCEPTUAL: t^2
+    {0, 256, 1024, 2304, 4096, 6400, 9216, 12544, 16384, 20736, 25600, 30976, 36864, 43264, 50176, 57600, 65535}
+};
+
+
+static unsigned short _envelope_progress(byte curve, unsigned short phase){
+    const unsigned short* points = _envelope_curves[curve];
+
+    byte i    = phase >> 12;
+    byte frac = phase >> 4;
+
+    unsigned short lo = pgm_read_word(&points[i]), hi = pgm_read_word(&points[i + 1]);
+
+    return lo + (((unsigned long)(hi - lo) * frac) >> 8);
+}
+
+
+void envelope_init(volatile envelope_t& env, unsigned short value){
+    env.value   = value;
+    env.target  = value;
+    env.running = false;
+}
+
+bool envelope_set_shape(volatile envelope_t& env, unsigned short ticks, byte curve){
+    if(curve >= ENVELOPE_CURVES) return false;
+
+    env.curve = curve;
+    env.rate  = ticks > 1 ? 65536UL / ticks : 0;
+
+    return true;
+}
+
+void envelope_start(volatile envelope_t& env, unsigned short target){
+    env.target  = target;
+    env.from    = env.value;
+    env.falling = target < env.value;
+    env.span    = env.falling ? env.value - target : target - env.value;
+    env.phase   = 0;
+    env.running = env.span != 0;
+}
+
+unsigned short envelope_tick(volatile envelope_t& env){
+    if(!env.running) return env.value;
+
+    // Done on the tick which would wrap the phase
+    if(!env.rate || env.phase > 0xffff - env.rate){
+        env.value   = env.target;
+        env.running = false;
+        return env.value;
+    }
+
+    env.phase += env.rate;
+
+    unsigned short progress;
+    if(env.falling){
+        progress = 0xffff - _envelope_progress(env.curve, 0xffff - env.phase);
+    } else {
+        progress = _envelope_progress(env.curve, env.phase);
+    }
+
+    unsigned short delta = ((unsigned long)env.span * progress) >> 16;
+    env.value = env.falling ? env.from - delta : env.from + delta;
+
+    return env.value;
+}
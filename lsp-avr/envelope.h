@@ -0,0 +1,55 @@
+#ifndef LSP_ENVELOPE_H
+#define LSP_ENVELOPE_H 1
+
+/*
+    Envelope: moves a 16 bit value to a target over a given number of ticks,
+    following a curve. It drives the output brightness.
+
+    The progress is a Q0.16 phase, advanced every tick by a rate computed when
+    the duration is set, so a tick costs a table lookup and a multiplication
+    (no division). The curves are tables of ENVELOPE_CURVE_LEN + 1 points,
+    interpolated. A falling envelope runs its curve mirrored, so that the
+    perceptual curve eases in going up and out going down.
+    Changing the target while running restarts the envelope from the current
+    value, so there's no jump
+*/
+
+#include <Arduino.h>
+
+
+#define ENVELOPE_LINEAR     0
+#define ENVELOPE_EASE       1  // Ease-in-out (smoothstep)
+#define ENVELOPE_PERCEPTUAL 2  // Quadratic, the eye sees a brightness ramp from/to 0 as linear
+#define ENVELOPE_CURVES     3
+
+#define ENVELOPE_CURVE_LEN  16
+
+
+typedef struct {
+    unsigned short value;
+    unsigned short target;
+
+    unsigned short from, span;  // The value goes from 'from' to from +/- span
+    bool           falling;
+
+    unsigned short phase;       // Q0.16, 0 when idle
+    unsigned short rate;        // Phase per tick, 0: the next tick reaches the target
+    bool           running;
+
+    byte           curve;       // ENVELOPE_*
+} envelope_t;
+
+
+// Sets value and target to value, stops the envelope
+void envelope_init(volatile envelope_t& env, unsigned short value);
+
+// Duration (in ticks) and curve of the next envelopes. Returns false if the curve doesn't exist
+bool envelope_set_shape(volatile envelope_t& env, unsigned short ticks, byte curve);
+
+// Starts moving the value to target from where it is
+void envelope_start(volatile envelope_t& env, unsigned short target);
+
+// Advances the envelope by a tick, returns the new value
+unsigned short envelope_tick(volatile envelope_t& env);
+
+#endif
@@ -4,22 +4,39 @@
  * B: Timer2.A -> PB3 -> DigPin11
  * 
  * SERIAL Activity LED -> PB5
+ * Strip data (CFG_STRIP_PIXELS) -> PD7 -> DigPin7
  */
 
-#include <SoftwareSerial.h>
 #include <TimerOne.h>
+#include <util/crc16.h>
 
 #include "vm.h"
+#include "slots.h"
+#include "output.h"
+#include "strip.h"
+#include "envelope.h"
+#include "audio_rx.h"
 #include "config.h"
 
 
 #if CFG_AUDIO_SERIAL
-    SoftwareSerial AudioSerial(10, -1);
-
     static void init_serial(){
-        AudioSerial.begin(CFG_AUDIO_BAUDRATE);
+        audio_rx_init();
+
+        // Pin 10 (PB2) from the ASK filter, input with pull-up, pin change interrupt
+        DDRB   &= ~(1 << DDB2);
+        PORTB  |= (1 << PB2);
+        PCMSK0 |= (1 << PCINT2);
+        PCICR  |= (1 << PCIE0);
+
         Serial.begin(9600);
     }
+
+    // Falling edges are the start of the carrier bursts
+    ISR(PCINT0_vect){
+        // micros() counts 64 per microsecond here, which audio_rx expects (AUDIO_RX_CLK_PER_US)
+        if(!(PINB & (1 << PB2))) audio_rx_edge(micros());
+    }
 #else
     static void init_serial(){
         Serial.begin(115200);
@@ -27,21 +44,162 @@
 #endif
 
 
-// lsp intruction memory, or simply "the program"
-volatile byte lsp_imem[MAX_PROG_LEN];
+// lsp intruction memory, or simply "the program". With double buffering one
+// buffer holds the running program and the console loads the next one in the other
+#if CFG_IMEM_DOUBLE_BUFFER
+    #define IMEM_BUFFERS 2
+#else
+    #define IMEM_BUFFERS 1
+#endif
+
+volatile byte lsp_imem[IMEM_BUFFERS][VM_IMEM_SIZE];
 
 volatile vm_state_t lsp_vm;
 
-// 0 -> min, 255 -> max (MSB)
-volatile unsigned short brightness = 0;
-volatile unsigned short target_brightness = 0;
+// 0 -> min, 255 -> max (MSB of the value), animated by timer1_isr
+volatile envelope_t brightness;
 
 // Serial activity led counters
 volatile unsigned short aled_cnt;
 volatile unsigned short aled_phase_cnt;
 
+// Milliseconds since boot, counted by timer1_isr. millis() can't be used: Timer0 runs
+// unprescaled for the PWM, so it runs 64 times too fast
+volatile unsigned long ticks_ms;
+
+static unsigned long ticks_now(){
+    noInterrupts();
+    unsigned long t = ticks_ms;
+    interrupts();
+
+    return t;
+}
+
+
+#if CFG_ISR_STATS
+    // timer1_isr statistics, times are in cpu cycles
+    typedef struct {
+        unsigned long  ticks;
+        unsigned short vm_min, vm_max;  // spent in vm_step
+        unsigned long  vm_sum;
+        unsigned short inst_max;        // instructions executed by vm_step
+        unsigned long  inst_sum;
+        unsigned short lat_min, lat_max;  // from the timer overflow to the isr entry
+        unsigned short overruns;          // ticks which ended after the next one was due
+    } isr_stats_t;
+
+    volatile isr_stats_t isr_stats;
+
+    static void isr_stats_reset(){
+        noInterrupts();
+        isr_stats.ticks    = 0;
+        isr_stats.vm_min   = 0xffff;
+        isr_stats.vm_max   = 0;
+        isr_stats.vm_sum   = 0;
+        isr_stats.inst_max = 0;
+        isr_stats.inst_sum = 0;
+        isr_stats.lat_min  = 0xffff;
+        isr_stats.lat_max  = 0;
+        isr_stats.overruns = 0;
+        interrupts();
+    }
+
+    // Cycles since the start of the current tick. TimerOne runs Timer1 in phase and frequency
+    // correct mode with no prescaler: TCNT1 counts from 0 up to ICR1 and then back down,
+    // and the overflow interrupt fires at 0. Two reads tell the direction
+    static inline unsigned short timer1_pos(){
+        unsigned short a = TCNT1;
+        unsigned short b = TCNT1;
+
+        return b >= a ? b : 2 * ICR1 - b;
+    }
+
+    static void isr_stats_update(unsigned short t_entry, unsigned short t_vm, unsigned short t_end, unsigned short insts){
+        unsigned short vm_cycles = t_end >= t_vm ? t_end - t_vm : t_end + 2 * ICR1 - t_vm;
+
+        isr_stats.ticks++;
+
+        if(vm_cycles < isr_stats.vm_min) isr_stats.vm_min = vm_cycles;
+        if(vm_cycles > isr_stats.vm_max) isr_stats.vm_max = vm_cycles;
+        isr_stats.vm_sum += vm_cycles;
+
+        if(insts > isr_stats.inst_max) isr_stats.inst_max = insts;
+        isr_stats.inst_sum += insts;
+
+        if(t_entry < isr_stats.lat_min) isr_stats.lat_min = t_entry;
+        if(t_entry > isr_stats.lat_max) isr_stats.lat_max = t_entry;
+
+        // The overflow flag is cleared when entering the isr, if it's set again the next tick is already due
+        if(TIFR1 & (1 << TOV1)) isr_stats.overruns++;
+    }
+
+    static void isr_stats_print(){
+        isr_stats_t s;
+
+        noInterrupts();
+        s.ticks    = isr_stats.ticks;
+        s.vm_min   = isr_stats.vm_min;
+        s.vm_max   = isr_stats.vm_max;
+        s.vm_sum   = isr_stats.vm_sum;
+        s.inst_max = isr_stats.inst_max;
+        s.inst_sum = isr_stats.inst_sum;
+        s.lat_min  = isr_stats.lat_min;
+        s.lat_max  = isr_stats.lat_max;
+        s.overruns = isr_stats.overruns;
+        interrupts();
+
+        if(!s.ticks){
+            OUT_SERIAL.println(F("No ticks"));
+            return;
+        }
+
+        OUT_SERIAL.print(F("ticks "));
+        OUT_SERIAL.println(s.ticks);
+
+        OUT_SERIAL.print(F("vm cyc min/avg/max "));
+        OUT_SERIAL.print(s.vm_min); OUT_SERIAL.print(' ');
+        OUT_SERIAL.print(s.vm_sum / s.ticks); OUT_SERIAL.print(' ');
+        OUT_SERIAL.print(s.vm_max); OUT_SERIAL.print(F(" of "));
+        OUT_SERIAL.println(2 * ICR1);
+
+        OUT_SERIAL.print(F("inst avg/max "));
+        OUT_SERIAL.print(s.inst_sum / s.ticks); OUT_SERIAL.print(' ');
+        OUT_SERIAL.println(s.inst_max);
+
+        OUT_SERIAL.print(F("lat cyc min/max "));
+        OUT_SERIAL.print(s.lat_min); OUT_SERIAL.print(' ');
+        OUT_SERIAL.println(s.lat_max);
+
+        OUT_SERIAL.print(F("overruns "));
+        OUT_SERIAL.println(s.overruns);
+
+        OUT_SERIAL.print(F("vm preemptions "));
+        OUT_SERIAL.println(lsp_vm.preempt_cnt);
+
+        OUT_SERIAL.print(F("irq queue overflows "));
+        OUT_SERIAL.println(lsp_vm.irq_overflow);
+    }
+#endif
+
+
+#if CFG_STRIP_PIXELS
+    static bool strip_hold();
+#endif
 
 void timer1_isr(){
+  #if CFG_ISR_STATS
+    unsigned short t_entry = timer1_pos();
+  #endif
+
+  #if CFG_AUDIO_SERIAL
+    // Let the audio receiver timestamp its edges during the tick. The tick itself stays
+    // masked, so a late one is still run right after this one like without nesting
+    TIMSK1 &= ~(1 << TOIE1);
+    interrupts();
+  #endif
+
+    ticks_ms++;
+
     // Activity led
     if(aled_cnt){
         if(!aled_phase_cnt){
@@ -56,45 +214,769 @@ void timer1_isr(){
     }
 
     // Brightness animation
-    static unsigned short last_target_brightness = 0, brightness_count;
-    static   signed short brightness_step = 0;
-    if(brightness != target_brightness){
-        if(brightness == 0){
+    if(brightness.running){
+        if(brightness.value == 0){
             // enable PWM outputs (they were off)
             TCCR0A |= (1 << COM0A1) | (1 << COM0B1);
             TCCR2A |= (1 << COM2A1);
         }
-        
-        if(target_brightness != last_target_brightness){
-            // Recompute deltas
-            last_target_brightness = target_brightness;
 
-            register signed short h_target   = target_brightness >> 1;
-            register signed short h_bright   = brightness >> 1;
-            register signed short s_duration = CFG_BRIGHTNESS_ADJ_MS;
+        envelope_tick(brightness);
+
+        if(!brightness.running && brightness.value == 0){
+            // disable PWM outputs (they were on)
+            TCCR0A &= ~((1 << COM0A1) | (1 << COM0B1));
+            TCCR2A &= ~(1 << COM2A1);
+        }
+    }
+
+    output_tick(brightness.value >> 8);
+    
+  #if CFG_ISR_STATS
+    unsigned short t_vm  = timer1_pos();
+    unsigned short insts = vm_step(lsp_vm, false);
+
+    isr_stats_update(t_entry, t_vm, timer1_pos(), insts);
+  #else
+    vm_step(lsp_vm, false);
+  #endif
+
+  #if CFG_STRIP_PIXELS
+    // After the VM, so that a cmt goes out in its own tick
+    if(!strip_hold()) strip_show(brightness.value >> 8);
+  #endif
+
+  #if CFG_AUDIO_SERIAL
+    noInterrupts();
+    TIMSK1 |= (1 << TOIE1);
+  #endif
+}
+
+
+
+// Serial console state. The console loads programs into lsp_imem[load_buf]
+static byte           load_buf = 0;
+static unsigned int   imem_len = 0;
+static bool           imem_running = false;  // The load buffer holds the program the VM runs (what 'e' stores)
+static unsigned short target_brightness = 0;
+static unsigned short saved_brightness = 0;
+static bool           output_enabled = false;
+
+
+// Starts the brightness envelope towards target
+static void set_brightness(unsigned short target){
+    target_brightness = target;
+
+    noInterrupts();
+    envelope_start(brightness, target);
+    interrupts();
+}
+
+
+// Makes the VM run the program in lsp_imem[load_buf]: if reset is set the VM is reset on it
+// (and left paused, like 'R'), otherwise it switches to it on the next tick ('P', needs double
+// buffering). With double buffering load_buf then moves to the other buffer, which gets a
+// copy of the running program. Returns the link result
+static unsigned short run_program(bool reset){
+    unsigned short link_res;
+
+  #if CFG_IMEM_DOUBLE_BUFFER
+    if(reset) link_res = vm_reset(lsp_vm, lsp_imem[load_buf], imem_len);
+    else      link_res = vm_switch_program(lsp_vm, lsp_imem[load_buf], imem_len);
+
+    // After a failed switch the VM still runs the other buffer
+    if(reset || link_res == VM_LINK_OK){
+        memcpy((byte*)lsp_imem[load_buf ^ 1], (byte*)lsp_imem[load_buf], imem_len + 1);
+        load_buf ^= 1;
+    }
+  #else
+    link_res = vm_reset(lsp_vm, lsp_imem[load_buf], imem_len);
+  #endif
+
+    imem_running = link_res == VM_LINK_OK;
+
+    return link_res;
+}
+
+
+/*
+    Console parser. It's fed one byte at a time and never waits for the serial port, so a
+    slow or broken sender can't stall the loop (and the commands after it).
+
+    A command is a char followed by its decimal arguments (see console_argc), optionally
+    preceded by spaces. An argument ends at the first byte which isn't a digit: a space
+    separates it from the next argument; after the last argument that byte is
+    parsed as the next command ("w12w34" are two commands), so a command is executed as soon
+    as the byte after it arrives, usually a newline. A command with a missing, empty or
+    out of range (> 65535) argument is malformed and discarded.
+    If the sender stops in the middle of a command for CFG_CONSOLE_TIMEOUT_MS, a command missing
+    just the end of its last argument is executed anyway, any other one is malformed.
+
+    'W' is followed by a binary frame:
+        length (16 bit, little endian), bytecode, crc (16 bit, little endian)
+    where crc is the CRC-CCITT (avr-libc _crc_ccitt_update, initial value 0xffff) of the length
+    and the bytecode. The bytecode goes into the load buffer; a frame which is too long, truncated
+    (by the timeout) or corrupted drops the program in the load buffer
+*/
+
+#define CON_CMD        0  // Waiting for a command
+#define CON_ARGS       1  // Reading the arguments
+#define CON_SKIP       2  // Discarding the digits of an out of range argument
+#define CON_FRAME_LEN  3  // 'W' frame
+#define CON_FRAME_DATA 4
+#define CON_FRAME_CRC  5
+#define CON_PATCH_LEN  6  // 'X' frame
+#define CON_PATCH_RUNS 7
+#define CON_PATCH_RUN  8
+#define CON_PATCH_DATA 9
+#define CON_PATCH_CRC  10
+
+static struct {
+    byte           state;     // CON_*
+    char           cmd;
+    byte           argc;      // Arguments the command takes
+    byte           argn;      // Arguments completed
+    bool           in_arg;    // Reading the digits of args[argn]
+    unsigned short args[3];
+
+    // 'W' frame
+    unsigned short frame_len, frame_pos, frame_crc;
+    byte           frame_crc_lsb;
+
+    // 'X' frame, frame_len is the new program length
+    byte           patch_runs, patch_cnt;
+    unsigned short patch_off;
+    bool           patch_ok;
+
+    unsigned long  last_byte_ms;
+
+    // Malformed or unknown commands. Saturates at 0xffff
+    unsigned short malformed;
+} con;
+
+static void console_malformed(){
+    if(con.malformed != 0xffff) con.malformed++;
+}
+
+// Number of decimal arguments of a command
+static byte console_argc(char cmd){
+    switch(cmd){
+        case 'b':
+        case 'w':
+        case 'e':
+        case 'B':
+            return 1;
+
+        case 'I':
+        case 'f':
+        case 'l':
+            return 2;
+
+        case 'O':
+            return 3;
+
+        default:
+            return 0;
+    }
+}
+
+// Executes a parsed command, returns false if it wasn't one (whitespace or unknown)
+static bool console_exec(char cmd, unsigned short* args){
+    switch(cmd){
+        case '\n':
+        case '\r':
+        case '\t':
+        case ' ':
+            return false;
+
+        case '(':
+            set_brightness(saved_brightness);
+            output_enabled = true;
+            
+            OUT_SERIAL.println(F("Out: on"));
+            break;
+           
+        case ')':
+            saved_brightness = target_brightness;
+            set_brightness(0);
+            output_enabled = 0;
+            
+            OUT_SERIAL.println(F("Out: off"));
+            break;
 
-            brightness_step  = ((h_target - h_bright) / s_duration) * 2;
-            brightness_count = CFG_BRIGHTNESS_ADJ_MS;
+        case 'b': {
+            byte wanted_brightness = args[0];
+            if(output_enabled){
+                set_brightness(wanted_brightness << 8);
+            } else {
+                saved_brightness = wanted_brightness << 8;
+            }
+            break;
         }
 
-        brightness += brightness_step;
-        brightness_count--;
+        case 'f': {
+            noInterrupts();
+            bool ok = envelope_set_shape(brightness, args[0], args[1]);
+            interrupts();
 
-        if(!brightness_count){
-            brightness = target_brightness;
+            if(ok){
+                OUT_SERIAL.println(F("Brightness ramp set"));
+            } else {
+                OUT_SERIAL.println(F("Unknown curve"));
+            }
+            break;
+        }
 
-            if(brightness == 0){
-                // disable PWM outputs (they were on)
-                
-                TCCR0A &= ~((1 << COM0A1) | (1 << COM0B1));
-                TCCR2A &= ~(1 << COM2A1);
+        case 'I': {
+            if(vm_request_interrupt(lsp_vm, args[0], args[1])){
+                OUT_SERIAL.println(F("Requesting interrupt"));
+            } else {
+                OUT_SERIAL.println(F("Interrupt dropped"));
             }
+            break;
+        }
+
+        case '[':
+            vm_set_pause(lsp_vm, true);
+            
+            OUT_SERIAL.println(F("VM pause"));
+            break;
+
+        case ']':
+            vm_set_pause(lsp_vm, false);
+
+            OUT_SERIAL.println(F("VM unpause"));
+            break;
+
+        case 'r':
+            imem_len     = 0;
+            imem_running = false;
+            break;
+
+        case 'w': {
+            if(imem_len < MAX_PROG_LEN) lsp_imem[load_buf][imem_len++] = args[0];
+            imem_running = false;
+            break;
         }
+
+        case 'R': {
+            unsigned short link_res = run_program(true);
+
+            if(link_res == VM_LINK_OK){
+                OUT_SERIAL.println(F("VM reset"));
+            } else {
+                OUT_SERIAL.print(F("VM reset, link error at "));
+                OUT_SERIAL.println(link_res, HEX);
+            }
+            break;
+        }
+
+      #if CFG_IMEM_DOUBLE_BUFFER
+        case 'P': {
+            // After a failed 'W' or 'X' the old program keeps running
+            if(!imem_len){
+                OUT_SERIAL.println(F("No program to switch to"));
+                break;
+            }
+
+            // Returns once the VM has switched, at most a tick later
+            unsigned short link_res = run_program(false);
+
+            if(link_res == VM_LINK_OK){
+                OUT_SERIAL.println(F("Program switched"));
+            } else {
+                OUT_SERIAL.print(F("Link error at "));
+                OUT_SERIAL.println(link_res, HEX);
+            }
+            break;
+        }
+      #endif
+
+      #if CFG_EEPROM_SLOTS
+        case 'e': {
+            // Only the running program: after a failed 'W' or 'X' (or one not switched to yet)
+            // the load buffer holds something else, which would replace the slot and boot
+            byte slot = args[0];
+
+            if(!imem_running || !imem_len){
+                OUT_SERIAL.println(F("No running program to store"));
+                break;
+            }
+
+            if(slots_store(slot, (byte*)lsp_imem[load_buf], imem_len)){
+                slots_set_boot(slot);
+
+                OUT_SERIAL.print(F("Stored to slot "));
+                OUT_SERIAL.println(slot);
+            } else {
+                OUT_SERIAL.println(F("Bad slot or program too long"));
+            }
+            break;
+        }
+
+        case 'l': {
+            byte slot = args[0];
+
+            // args[1] is the crc of the program the sender expects there (as 'L' lists it),
+            // a slot which holds another one is refused before the load buffer is touched
+            if(!slots_len(slot) || slots_crc(slot) != args[1]){
+                OUT_SERIAL.println(F("Bad slot or another program"));
+                break;
+            }
+
+            int len = slots_load(slot, (byte*)lsp_imem[load_buf]);
+
+            if(len < 0){
+                // The load buffer may be partially overwritten
+                imem_len     = 0;
+                imem_running = false;
+
+                OUT_SERIAL.println(F("Bad or empty slot"));
+                break;
+            }
+
+            imem_len = len;
+
+            // Switch without a pause if possible, otherwise reset and restart the VM
+            unsigned short link_res = run_program(!CFG_IMEM_DOUBLE_BUFFER);
+
+            if(link_res == VM_LINK_OK){
+                vm_set_pause(lsp_vm, false);
+                slots_set_boot(slot);
+
+                OUT_SERIAL.print(F("Running slot "));
+                OUT_SERIAL.println(slot);
+            } else {
+                OUT_SERIAL.print(F("Link error at "));
+                OUT_SERIAL.println(link_res, HEX);
+            }
+            break;
+        }
+
+        case 'L':
+            for(byte s = 0;s < CFG_EEPROM_SLOTS;s++){
+                OUT_SERIAL.print(s);
+                OUT_SERIAL.print(s == slots_boot() ? F("* len ") : F("  len "));
+                OUT_SERIAL.print(slots_len(s));
+                OUT_SERIAL.print(F(" crc "));
+                OUT_SERIAL.println(slots_crc(s));
+            }
+            break;
+      #endif
+
+      #if CFG_VM_BUILTINS
+        case 'B':
+            // Switches like 'P', the load buffer is left untouched
+            if(vm_switch_builtin(lsp_vm, args[0])){
+                OUT_SERIAL.print(F("Running built-in "));
+                OUT_SERIAL.println(args[0]);
+            } else {
+                OUT_SERIAL.println(F("Bad built-in program"));
+            }
+            break;
+      #endif
+
+        case 's':
+            vm_step(lsp_vm, true);
+            break;
+
+        case 'O':
+            OUT_SERIAL.println(F("Manual Override"));
+            noInterrupts();
+            output_override(args[0], args[1], args[2]);
+            interrupts();
+            break;
+        
+        case 'D':
+            for(unsigned short i = 0;i < imem_len;i += 8){
+                if(i < 0x1000U) OUT_SERIAL.print('0');
+                if(i < 0x100U)  OUT_SERIAL.print('0');
+                if(i < 0x10U)   OUT_SERIAL.print('0');
+                OUT_SERIAL.print(i, HEX);
+                OUT_SERIAL.print(F(": "));
+                for(unsigned int j = 0;j < 8 && (i + j) < imem_len;j++){
+                    if(lsp_imem[load_buf][i + j] < 0x10) OUT_SERIAL.print('0');
+                    OUT_SERIAL.print(lsp_imem[load_buf][i + j], HEX);
+                    OUT_SERIAL.print(' ');
+                }
+                OUT_SERIAL.println();
+            }
+            break;
+
+        case 'S':
+          #if CFG_ISR_STATS
+            isr_stats_print();
+          #endif
+
+            OUT_SERIAL.print(F("malformed cmds "));
+            OUT_SERIAL.println(con.malformed);
+            break;
+
+        case 'Z':
+          #if CFG_ISR_STATS
+            isr_stats_reset();
+          #endif
+            con.malformed = 0;
+
+            OUT_SERIAL.println(F("Stats reset"));
+            break;
+
+        case '?':
+          #if CFG_ENABLE_HELP
+            OUT_SERIAL.println(F("lsp cmdline"));
+            OUT_SERIAL.println(F("  (              on (restore saved brightness)"));
+            OUT_SERIAL.println(F("  )              off (save bright. and set to 0)"));
+            OUT_SERIAL.println(F("  b<n>           set bright. (set saved if off)"));
+            OUT_SERIAL.println(F("  f<ms> <c>      bright. ramp time, curve (0 lin, 1 ease, 2 percept.)"));
+            OUT_SERIAL.println(F("  I<v> <a>       req. interrupt v, w/ arg a"));
+            OUT_SERIAL.println(F("  [              pause VM"));
+            OUT_SERIAL.println(F("  ]              unpause VM"));
+          #if CFG_EEPROM_SLOTS
+            OUT_SERIAL.println(F("  l<n> <c>       Load pgm from slot n if its crc is c, run it (boots it)"));
+            OUT_SERIAL.println(F("  e<n>           Store the running pgm to EEPROM slot n (boots it)"));
+            OUT_SERIAL.println(F("  L              List slots (* = boot slot)"));
+          #endif
+          #if CFG_VM_BUILTINS
+            OUT_SERIAL.println(F("  B<n>           Run built-in pgm n"));
+          #endif
+          #if CFG_ISR_STATS
+            OUT_SERIAL.println(F("  S              Print isr timing and console stats"));
+          #else
+            OUT_SERIAL.println(F("  S              Print console stats"));
+          #endif
+            OUT_SERIAL.println(F("  Z              Reset stats"));
+          #if CFG_IMEM_DOUBLE_BUFFER
+            OUT_SERIAL.println(F("  r              Rewind imem write index to 0 (to rewrite pgm)"));
+            OUT_SERIAL.println(F("  w <byte>       Write byte to imem and increments index"));
+            OUT_SERIAL.println(F("  W<frame>       Write whole pgm (binary len16, bytes, crc16)"));
+            OUT_SERIAL.println(F("  X<frame>       Patch pgm (binary len16, n8, n x (off16, cnt8, bytes), crc16)"));
+            OUT_SERIAL.println(F("  P              Link the pgm and switch to it on the next tick"));
+            OUT_SERIAL.println(F("These cmds have undefined behaviour if used with running VM"));
+          #else
+            OUT_SERIAL.println(F("These cmds have undefined behaviour if used with running VM"));
+            OUT_SERIAL.println(F("  r              Rewind imem write index to 0 (to rewrite pgm)"));
+            OUT_SERIAL.println(F("  w <byte>       Write byte to imem and increments index"));
+            OUT_SERIAL.println(F("  W<frame>       Write whole pgm (binary len16, bytes, crc16)"));
+          #endif
+            OUT_SERIAL.println(F("  R              Reset VM state and link the program"));
+            OUT_SERIAL.println(F("  s              Single step VM, with debug info printed here"));
+            OUT_SERIAL.println(F("  O <r> <g> <b>  Manual output override"));
+            OUT_SERIAL.println(F("  D              Dump imem"));
+          #endif
+            break;
+
+        default:
+            OUT_SERIAL.print(F("unk inst "));
+            OUT_SERIAL.println(cmd);
+
+            console_malformed();
+            return false;
+    }
+
+    return true;
+
+}
+
+static void console_frame_end(bool ok){
+    if(ok){
+        imem_len = con.frame_len;
+
+        OUT_SERIAL.print(F("Program written, len "));
+        OUT_SERIAL.println(imem_len);
+    } else {
+        // imem was partially overwritten, drop the program
+        imem_len = 0;
+
+        OUT_SERIAL.println(F("Program frame error"));
+    }
+
+    con.state = CON_CMD;
+}
+
+static void console_frame_feed(byte c){
+    switch(con.state){
+        case CON_FRAME_LEN:
+            con.frame_crc = _crc_ccitt_update(con.frame_crc, c);
+
+            if(!con.frame_pos){
+                con.frame_len = c;
+                con.frame_pos = 1;
+                return;
+            }
+
+            con.frame_len |= c << 8;
+            con.frame_pos  = 0;
+            con.state      = con.frame_len ? CON_FRAME_DATA : CON_FRAME_CRC;
+            return;
+
+        case CON_FRAME_DATA:
+            // Too long programs are still consumed, so that their bytes aren't parsed as commands
+            if(con.frame_pos < MAX_PROG_LEN) lsp_imem[load_buf][con.frame_pos] = c;
+            con.frame_crc = _crc_ccitt_update(con.frame_crc, c);
+
+            if(++con.frame_pos == con.frame_len){
+                con.frame_pos = 0;
+                con.state     = CON_FRAME_CRC;
+            }
+            return;
+
+        case CON_FRAME_CRC:
+            if(!con.frame_pos){
+                con.frame_crc_lsb = c;
+                con.frame_pos     = 1;
+                return;
+            }
+
+            console_frame_end(con.frame_len <= MAX_PROG_LEN && con.frame_crc == (con.frame_crc_lsb | (c << 8)));
+            return;
     }
-    
-    vm_step(lsp_vm, false);
 }
 
+#if CFG_IMEM_DOUBLE_BUFFER
+/*
+    'X' frame: patches the program in the load buffer (a copy of the running one
+    after 'P', 'R' or 'l'), so that a small change doesn't need the whole program.
+    Binary, 16 bit values in little endian:
+        new program length (16 bit), number of runs (8 bit)
+        for every run: offset (16 bit), byte count (8 bit, not 0), the bytes
+        crc of the patched program (16 bit, like the 'W' one: over the length and the bytes)
+    The runs are written as they arrive. The crc covers the bytes the runs didn't
+    touch too, so a patch made against another program is rejected as well
+*/
+static void console_patch_end(unsigned short crc){
+    if(con.patch_ok){
+        unsigned short tmpw = 0xffff;
+
+        tmpw = _crc_ccitt_update(tmpw, con.frame_len & 0xff);
+        tmpw = _crc_ccitt_update(tmpw, con.frame_len >> 8);
+        for(unsigned short i = 0;i < con.frame_len;i++) tmpw = _crc_ccitt_update(tmpw, lsp_imem[load_buf][i]);
+
+        con.patch_ok = tmpw == crc;
+    }
+
+    if(con.patch_ok){
+        imem_len = con.frame_len;
+
+        OUT_SERIAL.print(F("Program patched, len "));
+        OUT_SERIAL.println(imem_len);
+    } else {
+        // Drop the program, like a bad 'W' frame
+        imem_len = 0;
+
+        OUT_SERIAL.println(F("Program patch error"));
+    }
+
+    con.state = CON_CMD;
+}
+
+static void console_patch_next_run(){
+    con.state = --con.patch_runs ? CON_PATCH_RUN : CON_PATCH_CRC;
+}
+
+static void console_patch_feed(byte c){
+    switch(con.state){
+        case CON_PATCH_LEN:
+            if(!con.frame_pos){
+                con.frame_len = c;
+                con.frame_pos = 1;
+                return;
+            }
+
+            con.frame_len |= c << 8;
+            con.frame_pos  = 0;
+            if(con.frame_len > MAX_PROG_LEN) con.patch_ok = false;
+
+            con.state = CON_PATCH_RUNS;
+            return;
+
+        case CON_PATCH_RUNS:
+            con.patch_runs = c;
+            con.state      = c ? CON_PATCH_RUN : CON_PATCH_CRC;
+            return;
+
+        case CON_PATCH_RUN:
+            if(con.frame_pos < 2){
+                if(!con.frame_pos) con.patch_off  = c;
+                else               con.patch_off |= c << 8;
+
+                con.frame_pos++;
+                return;
+            }
+
+            con.patch_cnt = c;
+            con.frame_pos = 0;
+
+            // Runs out of the new program are still consumed. Not patch_off + c, which wraps
+            // around with 16 bit ints (and would write before lsp_imem)
+            if(!c || c > con.frame_len || con.patch_off > con.frame_len - c) con.patch_ok = false;
+
+            if(c) con.state = CON_PATCH_DATA;
+            else  console_patch_next_run();
+            return;
+
+        case CON_PATCH_DATA:
+            if(con.patch_ok) lsp_imem[load_buf][con.patch_off] = c;
+            con.patch_off++;
+
+            if(!--con.patch_cnt) console_patch_next_run();
+            return;
+
+        case CON_PATCH_CRC:
+            if(!con.frame_pos){
+                con.frame_crc_lsb = c;
+                con.frame_pos     = 1;
+                return;
+            }
+
+            console_patch_end(con.frame_crc_lsb | (c << 8));
+            return;
+    }
+}
+#endif
+
+static void console_feed(byte c){
+    con.last_byte_ms = ticks_now();
+
+    switch(con.state){
+        case CON_FRAME_LEN:
+        case CON_FRAME_DATA:
+        case CON_FRAME_CRC:
+            console_frame_feed(c);
+            return;
+
+      #if CFG_IMEM_DOUBLE_BUFFER
+        case CON_PATCH_LEN:
+        case CON_PATCH_RUNS:
+        case CON_PATCH_RUN:
+        case CON_PATCH_DATA:
+        case CON_PATCH_CRC:
+            console_patch_feed(c);
+            return;
+      #endif
+
+        case CON_SKIP:
+            if(c >= '0' && c <= '9') return;
+
+            // c is the next command
+            con.state = CON_CMD;
+            break;
+
+        case CON_ARGS:
+            if(c >= '0' && c <= '9'){
+                unsigned long arg = con.args[con.argn] * 10UL + (c - '0');
+
+                if(arg > 0xffff){
+                    console_malformed();
+                    con.state = CON_SKIP;
+                    return;
+                }
+
+                con.args[con.argn] = arg;
+                con.in_arg = true;
+                return;
+            }
+
+            if(con.in_arg){
+                con.in_arg = false;
+
+                if(++con.argn == con.argc){
+                    // Complete, c is the next command
+                    con.state = CON_CMD;
+                    if(console_exec(con.cmd, con.args)) aled_cnt = CFG_ALED_TIMEOUT_MS;
+                    break;
+                }
+            }
+
+            // Spaces before an argument
+            if(c == ' ' || c == '\t') return;
+
+            // Anything else means the argument is missing, c is the next command
+            console_malformed();
+            con.state = CON_CMD;
+            break;
+    }
+
+    // CON_CMD
+    if(c == 'W'){
+        imem_running  = false;
+        con.state     = CON_FRAME_LEN;
+        con.frame_pos = 0;
+        con.frame_crc = 0xffff;
+        return;
+    }
+
+  #if CFG_IMEM_DOUBLE_BUFFER
+    if(c == 'X'){
+        imem_running  = false;
+        con.state     = CON_PATCH_LEN;
+        con.frame_pos = 0;
+        con.patch_ok  = imem_len != 0;  // Nothing to patch after a failed frame
+        return;
+    }
+  #endif
+
+    con.cmd  = c;
+    con.argc = console_argc(c);
+
+    if(con.argc){
+        con.state  = CON_ARGS;
+        con.argn   = 0;
+        con.in_arg = false;
+        for(byte i = 0;i < 3;i++) con.args[i] = 0;
+        return;
+    }
+
+    // A command was received, reset the activity led counter
+    if(console_exec(c, con.args)) aled_cnt = CFG_ALED_TIMEOUT_MS;
+}
+
+#if CFG_STRIP_PIXELS
+    // The strip push keeps the interrupts off for 30 us per pixel, which would lose the
+    // serial input: it waits while a command is arriving
+    static bool strip_hold(){
+      #if CFG_AUDIO_SERIAL
+        return audio_rx_busy(micros());
+      #else
+        return con.state != CON_CMD || Serial.available();
+      #endif
+    }
+#endif
+
+// Called when there's no input, ends a command that the sender abandoned
+static void console_idle(){
+    if(con.state == CON_CMD) return;
+    if(ticks_now() - con.last_byte_ms < CFG_CONSOLE_TIMEOUT_MS) return;
+
+    switch(con.state){
+        case CON_ARGS:
+            // Only the byte after the last argument is missing
+            if(con.in_arg && con.argn + 1 == con.argc){
+                if(console_exec(con.cmd, con.args)) aled_cnt = CFG_ALED_TIMEOUT_MS;
+            } else {
+                console_malformed();
+            }
+            break;
+
+        case CON_FRAME_LEN:
+        case CON_FRAME_DATA:
+        case CON_FRAME_CRC:
+            console_frame_end(false);
+            break;
+
+      #if CFG_IMEM_DOUBLE_BUFFER
+        case CON_PATCH_LEN:
+        case CON_PATCH_RUNS:
+        case CON_PATCH_RUN:
+        case CON_PATCH_DATA:
+        case CON_PATCH_CRC:
+            con.patch_ok = false;
+            console_patch_end(0);
+            break;
+      #endif
+    }
+
+    con.state = CON_CMD;
+}
 
 
 void setup() {
@@ -110,152 +992,57 @@ void setup() {
     TCCR2B = 1 << CS20;
 
     // Initial duty cycle is 0%
-    OCR0A = 0;
-    OCR0B = 0;
-    OCR2A = 0;
+    output_init(0);
+
+  #if CFG_STRIP_PIXELS
+    strip_init();
+  #endif
 
     // Disable PWM outputs (yes i enabled them in the setup up there)
     TCCR0A &= ~((1 << COM0A1) | (1 << COM0B1));
     TCCR2A &= ~(1 << COM2A1);
 
     init_serial();
-    OUT_SERIAL.println("lsp init v1.1");
+    OUT_SERIAL.println(F("lsp init v1.1"));
 
-    vm_reset(lsp_vm, lsp_imem);
+    vm_reset(lsp_vm, lsp_imem[0], 0);
+
+    envelope_init(brightness, 0);
+    envelope_set_shape(brightness, CFG_BRIGHTNESS_ADJ_MS, CFG_BRIGHTNESS_CURVE);
+
+  #if CFG_ISR_STATS
+    isr_stats_reset();
+  #endif
 
     //
     Timer1.initialize(1000);
     Timer1.attachInterrupt(timer1_isr);
 
-    // This is the serial console state
-    unsigned int   imem_len = 0;
-    unsigned short saved_brightness = 0;
-    bool           output_enabled = false;
-    
-    while(1){
-      _loop_start:
-        char cmd = IN_SERIAL.read();
-        if(cmd < 0) continue;
-
-        switch(cmd){
-            case '\n':
-            case '\t':
-            case ' ':
-                continue;
-
-            case '(':
-                target_brightness = saved_brightness;
-                output_enabled = true;
-                
-                OUT_SERIAL.println("Out: on");
-                break;
-               
-            case ')':
-                saved_brightness = target_brightness;
-                target_brightness = 0;
-                output_enabled = 0;
-                
-                OUT_SERIAL.println("Out: off");
-                break;
-
-            case 'b': {
-                byte wanted_brightness = IN_SERIAL.parseInt();
-                if(output_enabled){
-                    target_brightness = wanted_brightness << 8;
-                } else {
-                    saved_brightness = wanted_brightness << 8;
-                }
-                break;
-            }
-
-            case 'I': {
-                byte ivect          = IN_SERIAL.parseInt();
-                unsigned short iarg = IN_SERIAL.parseInt();
-                vm_request_interrupt(lsp_vm, ivect, iarg);
-                
-                OUT_SERIAL.println("Requesting interrupt");
-                break;
-            }
+  #if CFG_EEPROM_SLOTS
+    slots_init();
 
-            case '[':
-                vm_set_pause(lsp_vm, true);
-                
-                OUT_SERIAL.println("VM pause");
-                break;
+    // Start the boot slot right away, the outputs stay off until '('
+    byte boot_slot = slots_boot();
+    if(boot_slot != SLOT_NONE){
+        int len = slots_load(boot_slot, (byte*)lsp_imem[load_buf]);
 
-            case ']':
-                vm_set_pause(lsp_vm, false);
-
-                OUT_SERIAL.println("VM unpause");
-                break;
+        if(len >= 0){
+            imem_len = len;
 
-            case 'r':
-                imem_len = 0;
-                break;
+            if(run_program(true) == VM_LINK_OK) vm_set_pause(lsp_vm, false);
 
-            case 'w':
-                lsp_imem[imem_len++] = IN_SERIAL.parseInt();
-                break;
-
-            case 'R':
-                vm_reset(lsp_vm, lsp_imem);
-
-                OUT_SERIAL.println("VM reset");
-                break;
-
-            case 's':
-                vm_step(lsp_vm, true);
-                break;
-
-            case 'O':
-                OUT_SERIAL.println("Manual Override");
-                OCR0A = IN_SERIAL.parseInt();
-                OCR0B = IN_SERIAL.parseInt();
-                OCR2A = IN_SERIAL.parseInt();
-                break;
-            
-            case 'D':
-                for(unsigned short i = 0;i < imem_len;i += 8){
-                    if(i < 0x1000U) OUT_SERIAL.print('0');
-                    if(i < 0x100U)  OUT_SERIAL.print('0');
-                    if(i < 0x10U)   OUT_SERIAL.print('0');
-                    OUT_SERIAL.print(i, HEX);
-                    OUT_SERIAL.print(": ");
-                    for(unsigned int j = 0;j < 8 && (i + j) < imem_len;j++){
-                        if(lsp_imem[i + j] < 0x10) OUT_SERIAL.print('0');
-                        OUT_SERIAL.print(lsp_imem[i + j], HEX);
-                        OUT_SERIAL.print(' ');
-                    }
-                    OUT_SERIAL.println();
-                }
-                break;
-
-            case '?':
-              #if CFG_ENABLE_HELP
-                OUT_SERIAL.println("lsp cmdline");
-                OUT_SERIAL.println("  (              on (restore saved brightness)");
-                OUT_SERIAL.println("  )              off (save bright. and set to 0)");
-                OUT_SERIAL.println("  b<n>           set bright. (set saved if off)");
-                OUT_SERIAL.println("  I<v> <a>       req. interrupt v, w/ arg a");
-                OUT_SERIAL.println("  [              pause VM");
-                OUT_SERIAL.println("  ]              unpause VM");
-                OUT_SERIAL.println("These cmds have undefined behaviour if used with running VM");
-                OUT_SERIAL.println("  r              Rewind imem write index to 0 (to rewrite pgm)");
-                OUT_SERIAL.println("  w <byte>       Write byte to imem and increments index");
-                OUT_SERIAL.println("  R              Reset VM state");
-                OUT_SERIAL.println("  s              Single step VM, with debug info printed here");
-                OUT_SERIAL.println("  O <r> <g> <b>  Manual output override");
-                OUT_SERIAL.println("  D              Dump imem");
-              #endif
-                break;
-
-            default:
-                OUT_SERIAL.print("unk inst ");
-                OUT_SERIAL.println(cmd);
-                goto _loop_start;
+            OUT_SERIAL.print(F("Boot slot "));
+            OUT_SERIAL.println(boot_slot);
+        } else {
+            OUT_SERIAL.println(F("Boot slot corrupted"));
         }
+    }
+  #endif
+    
+    while(1){
+        int c = IN_SERIAL_READ();
 
-        // A command was received, reset the activity led counter
-        aled_cnt = CFG_ALED_TIMEOUT_MS;
+        if(c < 0) console_idle();
+        else      console_feed(c);
     }
 }
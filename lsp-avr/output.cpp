@@ -0,0 +1,137 @@
+#include <Arduino.h>
+
+#include "output.h"
+#include "config.h"
+
+
+// PWM level (8.8) of the oreg MSB i << OUTPUT_LUT_SHIFT, for the brightness _out_lut_bright
+static unsigned short _out_lut[OUTPUT_LUT_LEN + 1];
+static byte           _out_lut_bright;
+static byte           _out_lut_pos;   // Next entry to rebuild
+static byte           _out_lut_left;  // Entries to rebuild
+
+// Per channel: committed oreg, its PWM level
+static unsigned short _out_val[3];
+static unsigned short _out_level[3];
+
+#if CFG_OUT_DITHER
+    static byte _out_err[3];
+#endif
+
+
+static unsigned short _out_lut_entry(byte i, byte bright){
+    unsigned short msb = (unsigned short)i << OUTPUT_LUT_SHIFT;
+
+  #if CFG_OUT_GAMMA
+    // msb^2 / 255 * bright, with x / 255 ~ (x + x / 256) / 256
+    unsigned long tmpl = (unsigned long)msb * msb * bright;
+    return (tmpl + (tmpl >> 8)) >> 8;
+  #else
+    return msb * bright;
+  #endif
+}
+
+static unsigned short _out_level_of(unsigned short val){
+    byte i    = val >> (8 + OUTPUT_LUT_SHIFT);
+    byte frac = val >> OUTPUT_LUT_SHIFT;
+
+  #if !CFG_OUT_DITHER
+    // MSB only
+    frac &= 0xff << (8 - OUTPUT_LUT_SHIFT);
+  #endif
+
+    unsigned short lo = _out_lut[i], hi = _out_lut[i + 1];
+
+    // Half rebuilt table
+    if(hi < lo) return lo;
+
+    // lo + (hi - lo) * frac / 256, as two 8x8 bit multiplications
+    unsigned short delta = hi - lo;
+    return lo + (((unsigned short)(byte)delta * frac) >> 8) + (delta >> 8) * frac;
+}
+
+static inline void _out_pwm(byte ch, byte pwm){
+    switch(ch){
+        case 0: OCR0A = pwm; break;
+        case 1: OCR0B = pwm; break;
+        case 2: OCR2A = pwm; break;
+    }
+}
+
+static void _out_set(byte ch, unsigned short val){
+    unsigned short level = _out_level_of(val);
+
+    _out_val[ch] = val;
+
+    // Leaves the dithered output alone when nothing changed
+    if(level == _out_level[ch]) return;
+
+    _out_level[ch] = level;
+    _out_pwm(ch, level >> 8);
+}
+
+
+void output_init(byte bright){
+    for(byte i = 0;i <= OUTPUT_LUT_LEN;i++) _out_lut[i] = _out_lut_entry(i, bright);
+
+    _out_lut_bright = bright;
+    _out_lut_pos    = 0;
+    _out_lut_left   = 0;
+
+    for(byte ch = 0;ch < 3;ch++){
+        _out_val[ch]   = 0;
+        _out_level[ch] = 0;
+        _out_pwm(ch, 0);
+      #if CFG_OUT_DITHER
+        _out_err[ch] = 0;
+      #endif
+    }
+}
+
+void output_tick(byte bright){
+    if(bright != _out_lut_bright){
+        _out_lut_bright = bright;
+        _out_lut_left   = OUTPUT_LUT_LEN + 1;
+    }
+
+    if(_out_lut_left){
+        byte n = _out_lut_left < OUTPUT_LUT_CHUNK ? _out_lut_left : OUTPUT_LUT_CHUNK;
+        _out_lut_left -= n;
+
+        while(n--){
+            _out_lut[_out_lut_pos] = _out_lut_entry(_out_lut_pos, bright);
+            if(++_out_lut_pos > OUTPUT_LUT_LEN) _out_lut_pos = 0;
+        }
+
+        // The outputs follow the brightness without waiting for a commit
+        for(byte ch = 0;ch < 3;ch++) _out_set(ch, _out_val[ch]);
+    }
+
+  #if CFG_OUT_DITHER
+    for(byte ch = 0;ch < 3;ch++){
+        unsigned short tmpw = _out_err[ch] + (byte)_out_level[ch];
+        byte pwm = _out_level[ch] >> 8;
+
+        _out_err[ch] = tmpw;
+        if(tmpw >> 8 && pwm != 0xff) pwm++;
+
+        _out_pwm(ch, pwm);
+    }
+  #endif
+}
+
+void output_commit(unsigned short r, unsigned short g, unsigned short b, byte mask){
+    if(mask & 1) _out_set(0, r);
+    if(mask & 2) _out_set(1, g);
+    if(mask & 4) _out_set(2, b);
+}
+
+void output_override(byte r, byte g, byte b){
+    _out_level[0] = (unsigned short)r << 8;
+    _out_level[1] = (unsigned short)g << 8;
+    _out_level[2] = (unsigned short)b << 8;
+
+    OCR0A = r;
+    OCR0B = g;
+    OCR2A = b;
+}
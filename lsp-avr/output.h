@@ -0,0 +1,39 @@
+#ifndef LSP_OUTPUT_H
+#define LSP_OUTPUT_H 1
+
+/*
+    Output stage: turns the oregs committed by the VM into the PWM registers.
+
+    The PWM level of an oreg value comes from a table of OUTPUT_LUT_LEN + 1 entries,
+    the level of the oreg MSBs 0, 4, 8, ... 256 with the brightness and the gamma
+    curve (CFG_OUT_GAMMA) already applied, interpolated in between. The levels are
+    in 8.8 fixed point. The table is rebuilt when the brightness changes,
+    OUTPUT_LUT_CHUNK entries per tick, so a commit costs two lookups per channel.
+
+    With CFG_OUT_DITHER the fractional part of the levels (where the low byte of
+    the oregs ends up) is spread over the ticks: every tick the PWM register gets
+    the integer part, plus one when the channel's error accumulator overflows.
+    Without it the levels are the ones of the oreg MSB only
+*/
+
+#include <Arduino.h>
+
+
+#define OUTPUT_LUT_LEN   64
+#define OUTPUT_LUT_SHIFT 2   // log2(256 / OUTPUT_LUT_LEN)
+#define OUTPUT_LUT_CHUNK 16
+
+
+// Builds the whole table for bright (brightness MSB) and clears the outputs
+void output_init(byte bright);
+
+// Once per tick, before the VM step: follows the brightness (MSB) and dithers the outputs
+void output_tick(byte bright);
+
+// Latches the oregs in mask (bit i: oreg i) to the PWM outputs
+void output_commit(unsigned short r, unsigned short g, unsigned short b, byte mask);
+
+// Sets the PWM registers directly, until the next commit or brightness change
+void output_override(byte r, byte g, byte b);
+
+#endif
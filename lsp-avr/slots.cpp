@@ -0,0 +1,98 @@
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#include "slots.h"
+#include "vm.h"
+#include "config.h"
+
+
+#if CFG_EEPROM_SLOTS
+
+// Bump when the layout changes, the directory is formatted on the next boot
+#define SLOTS_MAGIC 0x4c
+
+#define _SLOTS_MAGIC_ADDR ((byte*)0)
+#define _SLOTS_BOOT_ADDR  ((byte*)1)
+#define _SLOTS_ENTRY(s)   ((uint16_t*)(2 + (s) * 4))
+
+
+static unsigned short _slots_crc(const byte* imem, unsigned short len){
+    unsigned short crc = 0xffff;
+
+    crc = _crc_ccitt_update(crc, len & 0xff);
+    crc = _crc_ccitt_update(crc, len >> 8);
+
+    for(unsigned short i = 0;i < len;i++) crc = _crc_ccitt_update(crc, imem[i]);
+
+    return crc;
+}
+
+static byte* _slots_data(byte slot){
+    return (byte*)(SLOTS_DIR_SIZE + slot * SLOTS_SLOT_SIZE);
+}
+
+
+void slots_init(){
+    if(eeprom_read_byte(_SLOTS_MAGIC_ADDR) == SLOTS_MAGIC) return;
+
+    for(byte s = 0;s < CFG_EEPROM_SLOTS;s++) eeprom_update_word(_SLOTS_ENTRY(s), 0);
+
+    eeprom_update_byte(_SLOTS_BOOT_ADDR, SLOT_NONE);
+    eeprom_update_byte(_SLOTS_MAGIC_ADDR, SLOTS_MAGIC);
+}
+
+
+bool slots_store(byte slot, const byte* imem, unsigned short len){
+    if(slot >= CFG_EEPROM_SLOTS || len > SLOTS_SLOT_SIZE) return false;
+
+    // Mark the slot empty while it's being written, a reset halfway leaves no half program
+    eeprom_update_word(_SLOTS_ENTRY(slot), 0);
+
+    // update only writes the bytes that changed, storing the same program again is (almost) free
+    eeprom_update_block(imem, _slots_data(slot), len);
+
+    eeprom_update_word(_SLOTS_ENTRY(slot) + 1, _slots_crc(imem, len));
+    eeprom_update_word(_SLOTS_ENTRY(slot), len);
+
+    return true;
+}
+
+
+int slots_load(byte slot, byte* imem){
+    unsigned short len = slots_len(slot);
+
+    if(!len || len > SLOTS_SLOT_SIZE || len > MAX_PROG_LEN) return -1;
+
+    eeprom_read_block(imem, _slots_data(slot), len);
+
+    if(_slots_crc(imem, len) != slots_crc(slot)) return -1;
+
+    return len;
+}
+
+
+unsigned short slots_len(byte slot){
+    if(slot >= CFG_EEPROM_SLOTS) return 0;
+
+    return eeprom_read_word(_SLOTS_ENTRY(slot));
+}
+
+unsigned short slots_crc(byte slot){
+    if(slot >= CFG_EEPROM_SLOTS) return 0;
+
+    return eeprom_read_word(_SLOTS_ENTRY(slot) + 1);
+}
+
+
+byte slots_boot(){
+    byte slot = eeprom_read_byte(_SLOTS_BOOT_ADDR);
+
+    return slot < CFG_EEPROM_SLOTS ? slot : SLOT_NONE;
+}
+
+void slots_set_boot(byte slot){
+    eeprom_update_byte(_SLOTS_BOOT_ADDR, slot);
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef LSP_SLOTS_H
+#define LSP_SLOTS_H 1
+
+/*
+    Program slots in the EEPROM (1 KB on the ATmega328P), so that the programs
+    used most often can be switched to by index instead of being sent again.
+
+    The EEPROM starts with a small directory:
+        magic (1 byte), boot slot (1 byte), then for every slot
+        length (16 bit), crc (16 bit)
+    followed by CFG_EEPROM_SLOTS fixed size slots. A length of 0 marks an empty slot.
+    The crc is the same as the one of the 'W' frame (CRC-CCITT, initial value 0xffff,
+    over the 16 bit length and the bytecode), so a slot can be matched to a frame
+*/
+
+#include <Arduino.h>
+
+
+#define SLOT_NONE 0xff
+
+// Directory bytes, rounded up so that the slots are aligned
+#define SLOTS_DIR_SIZE  ((2 + CFG_EEPROM_SLOTS * 4 + 15) & ~15)
+#define SLOTS_SLOT_SIZE (((E2END + 1) - SLOTS_DIR_SIZE) / CFG_EEPROM_SLOTS)
+
+
+// Checks the directory, and formats it if the EEPROM doesn't hold one
+void slots_init();
+
+// Stores a program, returns false if slot doesn't exist or the program doesn't fit
+bool slots_store(byte slot, const byte* imem, unsigned short len);
+
+// Loads a program into imem (which must hold MAX_PROG_LEN bytes). Returns its length,
+// or -1 if the slot doesn't exist, is empty or its content doesn't match the crc
+int slots_load(byte slot, byte* imem);
+
+// Length (0 if empty) and crc of a slot, as stored in the directory
+unsigned short slots_len(byte slot);
+unsigned short slots_crc(byte slot);
+
+// The slot loaded on boot, SLOT_NONE if none
+byte slots_boot();
+void slots_set_boot(byte slot);
+
+#endif
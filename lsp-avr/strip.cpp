@@ -0,0 +1,230 @@
+#include <Arduino.h>
+#include <string.h>
+
+#include "strip.h"
+#include "config.h"
+
+#if CFG_STRIP_PIXELS
+
+#if CFG_STRIP_PIXELS > 32
+    #error "CFG_STRIP_PIXELS is at most 32"
+#endif
+
+#define _STRIP_LEN CFG_STRIP_PIXELS
+
+
+byte strip_pixels[_STRIP_LEN][3];
+
+static bool _strip_changed;  // Since the last strip_commit
+static bool _strip_due;      // Waiting for strip_show
+static byte _strip_bright;   // Of the last push
+
+
+static byte _strip_index(unsigned short i){
+    return i < _STRIP_LEN ? i : _STRIP_LEN - 1;
+}
+
+// from and to of the range between a and b, lowest first
+static void _strip_range(unsigned short a, unsigned short b, byte& from, byte& to){
+    from = _strip_index(a);
+    to   = _strip_index(b);
+
+    if(from > to){
+        byte tmp = from;
+        from = to;
+        to   = tmp;
+    }
+}
+
+// Pixels in [from, to)
+static void _strip_reverse(byte from, byte to){
+    while(from + 1 < to){
+        to--;
+
+        for(byte ch = 0;ch < 3;ch++){
+            byte tmp = strip_pixels[from][ch];
+            strip_pixels[from][ch] = strip_pixels[to][ch];
+            strip_pixels[to][ch]   = tmp;
+        }
+
+        from++;
+    }
+}
+
+#ifdef __AVR__
+// One byte, most significant bit first. A bit is 20 cycles at 16 MHz (1.25 us), high for 6
+// of them for a 0 and 13 for a 1. The code between the bytes only makes the low phase of
+// the last bit longer, which the WS2812 allows (as long as it's way below the 50 us reset)
+static inline void _strip_byte(byte b, byte hi, byte lo){
+    byte n = 8;
+
+    asm volatile(
+        "1:                   \n\t"
+        "out  %[port], %[hi]  \n\t"  // 0
+        "rjmp .+0             \n\t"  // 1
+        "rjmp .+0             \n\t"  // 3
+        "sbrs %[b], 7         \n\t"  // 5
+        "out  %[port], %[lo]  \n\t"  // 6, the end of a 0
+        "rjmp .+0             \n\t"  // 7
+        "rjmp .+0             \n\t"  // 9
+        "rjmp .+0             \n\t"  // 11
+        "out  %[port], %[lo]  \n\t"  // 13, the end of a 1
+        "lsl  %[b]            \n\t"  // 14
+        "rjmp .+0             \n\t"  // 15
+        "dec  %[n]            \n\t"  // 17
+        "brne 1b              \n\t"  // 18
+        : [b] "+r" (b), [n] "+r" (n)
+        : [port] "I" (_SFR_IO_ADDR(PORTD)), [hi] "r" (hi), [lo] "r" (lo)
+    );
+}
+#endif
+
+
+void strip_init(){
+  #ifdef __AVR__
+    DDRD  |= 1 << STRIP_PIN;
+    PORTD &= ~(1 << STRIP_PIN);
+  #endif
+
+    memset(strip_pixels, 0, sizeof(strip_pixels));
+
+    _strip_changed = false;
+    _strip_due     = true;
+    _strip_bright  = 0;
+}
+
+void strip_fill(unsigned short a, unsigned short b, const byte* rgb){
+    byte from, to;
+    _strip_range(a, b, from, to);
+
+    for(byte i = from;i <= to;i++){
+        strip_pixels[i][0] = rgb[0];
+        strip_pixels[i][1] = rgb[1];
+        strip_pixels[i][2] = rgb[2];
+    }
+
+    _strip_changed = true;
+}
+
+void strip_grad(unsigned short a, unsigned short b){
+    byte from, to;
+    _strip_range(a, b, from, to);
+
+    byte span = to - from;
+    if(span < 2) return;
+
+    for(byte ch = 0;ch < 3;ch++){
+        // 8.8 fixed point, from the middle of the first level. The step is rounded towards 0,
+        // so it never goes past the last one
+        short          step = ((long)strip_pixels[to][ch] - strip_pixels[from][ch]) * 256 / span;
+        unsigned short acc  = ((unsigned short)strip_pixels[from][ch] << 8) + 0x80;
+
+        for(byte i = from + 1;i < to;i++){
+            acc += step;
+            strip_pixels[i][ch] = acc >> 8;
+        }
+    }
+
+    _strip_changed = true;
+}
+
+void strip_rotate(short n){
+    short r = n % _STRIP_LEN;
+    if(r < 0) r += _STRIP_LEN;
+    if(!r) return;
+
+    // Three reversals, without a second buffer
+    _strip_reverse(0, _STRIP_LEN);
+    _strip_reverse(0, r);
+    _strip_reverse(r, _STRIP_LEN);
+
+    _strip_changed = true;
+}
+
+void strip_shift(short n, const byte* rgb){
+    if(n >= _STRIP_LEN || n <= -_STRIP_LEN){
+        strip_fill(0, _STRIP_LEN - 1, rgb);
+        return;
+    }
+
+    if(n > 0){
+        memmove(strip_pixels[n], strip_pixels[0], (_STRIP_LEN - n) * 3);
+        strip_fill(0, n - 1, rgb);
+    } else if(n < 0){
+        n = -n;
+        memmove(strip_pixels[0], strip_pixels[n], (_STRIP_LEN - n) * 3);
+        strip_fill(_STRIP_LEN - n, _STRIP_LEN - 1, rgb);
+    }
+}
+
+void strip_scale(unsigned short n){
+    byte* p = strip_pixels[0];
+
+    for(byte i = 0;i < _STRIP_LEN * 3;i++){
+        unsigned long v = ((unsigned long)p[i] * n) >> 8;
+        p[i] = v > 0xff ? 0xff : v;
+    }
+
+    _strip_changed = true;
+}
+
+void strip_fade(unsigned short n, const byte* rgb){
+    if(n > 256) n = 256;
+    if(!n) return;
+
+    for(byte i = 0;i < _STRIP_LEN;i++){
+        for(byte ch = 0;ch < 3;ch++){
+            byte c = strip_pixels[i][ch], t = rgb[ch];
+
+            // Rounded up, so that it gets there
+            byte step = ((unsigned short)(c < t ? t - c : c - t) * n + 0xff) >> 8;
+            strip_pixels[i][ch] = c < t ? c + step : c - step;
+        }
+    }
+
+    _strip_changed = true;
+}
+
+void strip_get(unsigned short i, byte* rgb){
+    i = _strip_index(i);
+
+    rgb[0] = strip_pixels[i][0];
+    rgb[1] = strip_pixels[i][1];
+    rgb[2] = strip_pixels[i][2];
+}
+
+void strip_commit(){
+    if(!_strip_changed) return;
+
+    _strip_changed = false;
+    _strip_due     = true;
+}
+
+bool strip_show(byte bright){
+    if(!_strip_due && bright == _strip_bright) return false;
+
+    _strip_due    = false;
+    _strip_bright = bright;
+
+  #ifdef __AVR__
+    // The brightness is applied on the fly, in the low phase between the bytes
+    unsigned short scale = bright + 1;
+
+    byte sreg = SREG;
+    cli();
+
+    byte lo = PORTD & ~(1 << STRIP_PIN), hi = lo | (1 << STRIP_PIN);
+
+    for(byte i = 0;i < _STRIP_LEN;i++){
+        _strip_byte((strip_pixels[i][1] * scale) >> 8, hi, lo);
+        _strip_byte((strip_pixels[i][0] * scale) >> 8, hi, lo);
+        _strip_byte((strip_pixels[i][2] * scale) >> 8, hi, lo);
+    }
+
+    SREG = sreg;
+  #endif
+
+    return true;
+}
+
+#endif
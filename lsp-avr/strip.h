@@ -0,0 +1,62 @@
+#ifndef LSP_STRIP_H
+#define LSP_STRIP_H 1
+
+/*
+    Addressable strip output (CFG_STRIP_PIXELS): a frame buffer of WS2812 pixels in SRAM,
+    changed by the VM's pixel operations (vm_xop_e) and pushed to the strip by cmt.
+
+    The pixels are 3 bytes, R G B (the strip gets them as G R B). The operations take
+    pixel indices clamped to the last pixel, and ranges which include both ends, in any
+    order. A colour is 3 bytes, like the pixels: the VM passes the MSBs of the oregs.
+
+    strip_commit marks the frame as due if an operation changed it since the last commit,
+    strip_show pushes a due frame, or the whole frame again when the brightness changes
+    (the channels are scaled by it linearly, there's no gamma table like in output.h).
+    The push is bit-banged on STRIP_PIN (PD7, digital pin 7) with the interrupts off:
+    at 800 kHz it takes 30 us per pixel, which is why the firmware calls strip_show at
+    the end of the tick, only when the serial isn't receiving (see timer1_isr), and
+    limits the strip to 8 pixels with the serial over USB (see config.h).
+    On the host strip_show only reports the push
+*/
+
+#include <Arduino.h>
+
+
+// Data pin, bit of PORTD
+#define STRIP_PIN 7
+
+
+// R G B of every pixel, CFG_STRIP_PIXELS of them
+extern byte strip_pixels[][3];
+
+// Sets up the data pin and clears the frame, which is pushed on the first strip_show
+void strip_init();
+
+// Pixels from to to = rgb
+void strip_fill(unsigned short from, unsigned short to, const byte* rgb);
+
+// Pixels between from and to = linear gradient from the colour of pixel from to the one of pixel to
+void strip_grad(unsigned short from, unsigned short to);
+
+// Rotates the pixels by n, towards the end of the strip when positive
+void strip_rotate(short n);
+
+// Shifts the pixels by n like strip_rotate, the ones left empty = rgb
+void strip_shift(short n, const byte* rgb);
+
+// Every channel = channel * n / 256, up to 255
+void strip_scale(unsigned short n);
+
+// Every channel moves n / 256 (n > 256 is 256) of the way to rgb, at least by 1 when n isn't 0
+void strip_fade(unsigned short n, const byte* rgb);
+
+// rgb = pixel i
+void strip_get(unsigned short i, byte* rgb);
+
+// From cmt: the frame is due, if it changed
+void strip_commit();
+
+// Pushes the frame at the brightness bright (MSB) if it's due or bright changed, returns true if it did
+bool strip_show(byte bright);
+
+#endif
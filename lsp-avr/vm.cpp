@@ -1,18 +1,349 @@
 #include <Arduino.h>
+#include <avr/pgmspace.h>
 
 #include "vm.h"
+#include "output.h"
+#include "strip.h"
 #include "config.h"
 
 
-void vm_reset(volatile vm_state_t& vm, byte* imem){
-    // Initially paused
-    vm.is_paused = 1;
+// Host builds can watch every instruction the classic engine executes (see lspsim-prof in lsp-host),
+// and the register operations, whose cost depends on the data byte
+#ifdef VM_PROFILE
+    void vm_profile_inst(byte op_byte);
+    void vm_profile_xop(byte data);
+    #define VM_PROFILE_INST(op_byte) vm_profile_inst(op_byte)
+    #define VM_PROFILE_XOP(data)     vm_profile_xop(data)
+#else
+    #define VM_PROFILE_INST(op_byte)
+    #define VM_PROFILE_XOP(data)
+#endif
 
-    // No pending interrupt
-    vm.int_req = VM_INT_NONE;
 
-    // Program memory
-    vm.imem = imem;
+// Instruction length, opcode byte included
+static byte _vm_inst_len(byte inst){
+    switch(inst & 0B00001111){
+        // No data
+        case VM_OP_STOP:
+        case VM_OP_COMMIT:
+        case VM_OP_WAIT:
+        case VM_OP_IRET:
+            return 1;
+
+        // ivec, or context with the oregs mask
+        case VM_OP_IVEC:
+            return (inst & VM_IVEC_CONTEXT) ? 2 : 1;
+
+        // A single byte
+        case VM_OP_JMP:
+        case VM_OP_XOP:
+            return 2;
+
+        // ret, or call with 8/16 bit address
+        case VM_OP_CALL:
+            if(((inst >> 4) & 3) == VM_CALL_RET) return 1;
+            return (inst >> 7) ? 3 : 2;
+
+        // fwt, or target (8/16) and ticks (16)
+        case VM_OP_FADE:
+            if(((inst >> 4) & 3) == VM_FADE_WAIT) return 1;
+            return (inst >> 7) ? 5 : 4;
+
+        // Depends on is_word
+        default:
+            return (inst >> 7) ? 3 : 2;
+    }
+}
+
+#if CFG_VM_COMPRESSED && CFG_VM_ENGINE != 0
+    #error "CFG_VM_COMPRESSED needs CFG_VM_ENGINE 0"
+#endif
+
+#if CFG_VM_COMPRESSED
+    #define VM_CODE_MAX_LEN VM_Z_MAX_LEN
+#else
+    #define VM_CODE_MAX_LEN MAX_PROG_LEN
+#endif
+
+
+#if CFG_VM_COMPRESSED
+// Compressed images (see vm.h), must match lspvm-asm/lspc_z.py
+
+#define VM_Z_NONE 0xff
+#define VM_Z_BAD  0xffff
+
+// Placed before every block
+static const byte _vm_z_dict[] PROGMEM = {
+    0x02, 0x00, 0x12, 0x00, 0x22, 0xff, 0x04,
+    0x02, 0xff, 0x12, 0xff, 0x22, 0xff, 0x04,
+    0x02, 0x00, 0x12, 0x00, 0x22, 0x00,
+    0x04, 0x81, 0x88, 0x13, 0x03,
+    0x8d, 0xc8, 0x00,
+    0x07,
+};
+
+#define VM_Z_DICT_LEN sizeof(_vm_z_dict)
+
+// A decompressed block
+typedef struct {
+    byte block;  // VM_Z_NONE if the line is empty
+    byte data[VM_Z_BLOCK_LEN];
+} vm_z_line_t;
+
+// Decode window of the classic interpreter: the last two blocks it fetched from (the most
+// recently used is _vm_z_cache[_vm_z_mru]), so that a loop across a block boundary or a
+// subroutine called from another block don't decode a block at every fetch
+static vm_z_line_t _vm_z_cache[2];
+static byte        _vm_z_mru;
+
+static void _vm_z_flush(){
+    _vm_z_cache[0].block = VM_Z_NONE;
+    _vm_z_cache[1].block = VM_Z_NONE;
+}
+
+// Decompresses a block of image (image_len bytes, or at most that if it isn't known, holding
+// code_len bytes of bytecode) into line. Returns false if the block is malformed. The line
+// holds the block anyway, partially decoded (a program overwritten while it runs then costs
+// no more than a verified one), and nothing outside of it and of the image is touched
+static bool _vm_z_decode(const byte* image, unsigned short image_len, unsigned short code_len, byte block, vm_z_line_t* line){
+    byte nblocks = (code_len + VM_Z_BLOCK_LEN - 1) / VM_Z_BLOCK_LEN;
+    byte out     = 0;
+
+    unsigned short src, end, want;
+
+    want = code_len - block * VM_Z_BLOCK_LEN;
+    if(want > VM_Z_BLOCK_LEN) want = VM_Z_BLOCK_LEN;
+
+    line->block = block;
+
+    // Block 0 follows the offsets table, whose entry b - 1 is the start of block b
+    src = block ? image[2 * block] | (image[2 * block + 1] << 8) : 2 * nblocks;
+    end = block + 1 < nblocks ? image[2 * block + 2] | (image[2 * block + 3] << 8) : image_len;
+
+    if(end > image_len || src > end) return false;
+
+    while(out < want){
+        if(src == end) return false;
+
+        byte c = image[src++];
+        byte n;
+
+        if(c < 0x80){
+            // Literals
+            n = c + 1;
+            if(n > end - src || n > want - out) return false;
+
+            while(n--) line->data[out++] = image[src++];
+        } else if(c < 0xc0){
+            // Match, through the block and then the dictionary
+            n = (c & 0x3f) + 3;
+            if(src == end || n > want - out) return false;
+
+            unsigned short dist = image[src++] + 1;
+            if(dist > out + VM_Z_DICT_LEN) return false;
+
+            for(;n;n--,out++){
+                if(out >= dist) line->data[out] = line->data[out - dist];
+                else            line->data[out] = pgm_read_byte(&_vm_z_dict[VM_Z_DICT_LEN + out - dist]);
+            }
+        } else {
+            // Copy from the image
+            n = ((c >> 1) & 0x1f) + 3;
+            if(src == end || n > want - out) return false;
+
+            unsigned short off = ((c & 1) << 8) | image[src++];
+            if(off + n > image_len) return false;
+
+            while(n--) line->data[out++] = image[off++];
+        }
+    }
+
+    return true;
+}
+
+// Verifies an image (every block must decode to its length). Returns the length of its
+// bytecode, VM_Z_BAD if it's malformed
+static unsigned short _vm_z_check(const byte* image, unsigned short image_len){
+    vm_z_line_t line;
+
+    // No program
+    if(!image_len) return 0;
+
+    if(image_len < 2) return VM_Z_BAD;
+
+    unsigned short code_len = image[0] | (image[1] << 8);
+    byte           nblocks  = (code_len + VM_Z_BLOCK_LEN - 1) / VM_Z_BLOCK_LEN;
+
+    if(code_len > VM_Z_MAX_LEN || (nblocks ? 2 * nblocks : 2) > image_len) return VM_Z_BAD;
+
+    for(byte b = 0;b < nblocks;b++){
+        if(!_vm_z_decode(image, image_len, code_len, b, &line)) return VM_Z_BAD;
+    }
+
+    return code_len;
+}
+
+// The bytecode at addr, through line
+static byte _vm_z_read(const byte* image, unsigned short code_len, vm_z_line_t* line, unsigned short addr){
+    byte block = addr / VM_Z_BLOCK_LEN;
+
+    // The image was verified: MAX_PROG_LEN only keeps a program that gets overwritten while it runs in bounds
+    if(line->block != block) _vm_z_decode(image, MAX_PROG_LEN, code_len, block, line);
+
+    return line->data[addr % VM_Z_BLOCK_LEN];
+}
+
+// The interpreter's fetch. Past the end of the bytecode there is the 'hlt' sentinel
+static byte _vm_z_fetch(volatile vm_state_t& vm, unsigned short addr){
+    if(addr >= vm.imem_len) return VM_OP_STOP;
+
+    if(_vm_z_cache[_vm_z_mru].block != addr / VM_Z_BLOCK_LEN) _vm_z_mru ^= 1;
+
+    // Hit in the other line, or it's the least recently used one and gets the block
+    return _vm_z_read(vm.imem, vm.imem_len, &_vm_z_cache[_vm_z_mru], addr);
+}
+
+    #define VM_FETCH(addr) _vm_z_fetch(vm, addr)
+#else
+    #define VM_FETCH(addr) vm.imem[addr]
+#endif
+
+
+// Register operations the link accepts, the pixel ones only with a strip
+#if CFG_STRIP_PIXELS
+    #define _VM_XOP_KNOWN(xop) ((xop) <= VM_XOP_MODOUT || ((xop) >= VM_XOP_PFILL && (xop) <= VM_XOP_PGET))
+#else
+    #define _VM_XOP_KNOWN(xop) ((xop) <= VM_XOP_MODOUT)
+#endif
+
+// Builds the interrupt vector and context tables and verifies the program (see vm.h)
+static unsigned short _vm_link(byte* imem, unsigned short len, volatile unsigned short* ivec,
+                               volatile unsigned short* ctx_entry, volatile byte* ctx_outs){
+    // Bitmap of the instruction boundaries
+    byte starts[VM_CODE_MAX_LEN / 8];
+
+  #if CFG_VM_COMPRESSED
+    // Its own window: the interpreter could be running another program from its cache
+    vm_z_line_t line;
+    line.block = VM_Z_NONE;
+
+    #define _VM_LINK_AT(addr) _vm_z_read(imem, len, &line, addr)
+  #else
+    #define _VM_LINK_AT(addr) imem[addr]
+  #endif
+
+    unsigned short i;
+    byte op;
+
+    for(i = 0;i < sizeof(starts);i++) starts[i] = 0;
+    for(i = 0;i < 4;i++) ivec[i] = VM_IVEC_NONE;
+
+    // Context 0 owns the oregs no other context declared (and the unused one)
+    for(i = 1;i < VM_CONTEXTS;i++){
+        ctx_entry[i] = VM_IVEC_NONE;
+        ctx_outs[i]  = 0;
+    }
+
+    ctx_entry[0] = 0;
+    ctx_outs[0]  = 0x0f;
+
+    // First pass: opcodes, lengths and vectors
+    for(i = 0;i < len;i += _vm_inst_len(_VM_LINK_AT(i))){
+        op = _VM_LINK_AT(i) & 0B00001111;
+
+        if(i + _vm_inst_len(_VM_LINK_AT(i)) > len) return i;
+
+        // Reserved encodings
+        if(op == VM_OP_CALL && ((_VM_LINK_AT(i) >> 4) & 3) > VM_CALL_RET) return i;
+        if(op == VM_OP_XOP  && (!_VM_XOP_KNOWN(_VM_LINK_AT(i + 1) >> 4) || (_VM_LINK_AT(i + 1) & 0x0f) > 3)) return i;
+
+        starts[i >> 3] |= 1 << (i & 7);
+
+        if(op == VM_OP_IVEC){
+            byte v = (_VM_LINK_AT(i) >> 4) & 3;
+
+            if(_VM_LINK_AT(i) & VM_IVEC_CONTEXT){
+                // Context 0 is implicit, the others are declared once with at least an oreg, not owned by another context
+                byte outs = _VM_LINK_AT(i + 1);
+
+                if(!v || ctx_entry[v] != VM_IVEC_NONE || !outs || outs > 7 || (~ctx_outs[0] & outs)) return i;
+
+                ctx_outs[0] &= ~outs;
+                ctx_outs[v]  = outs;
+                ctx_entry[v] = i;
+            } else if(ivec[v] == VM_IVEC_NONE){
+                ivec[v] = i;
+            }
+        }
+    }
+
+    // Second pass: jump destinations
+    for(i = 0;i < len;i += _vm_inst_len(_VM_LINK_AT(i))){
+        byte is_word = _VM_LINK_AT(i) >> 7;
+        unsigned short next = i + _vm_inst_len(_VM_LINK_AT(i));
+        unsigned short dst;
+
+        switch(_VM_LINK_AT(i) & 0B00001111){
+            case VM_OP_DRJNZ:
+                if(is_word) dst = next + (signed short)(_VM_LINK_AT(i + 1) | (_VM_LINK_AT(i + 2) << 8));
+                else        dst = next + (signed char)_VM_LINK_AT(i + 1);
+                break;
+
+            case VM_OP_JMP:
+                dst = next + (signed char)_VM_LINK_AT(i + 1);
+                break;
+
+            case VM_OP_CALL:
+                if(((_VM_LINK_AT(i) >> 4) & 3) == VM_CALL_RET) continue;
+                // fall through
+            case VM_OP_JMPABS:
+            case VM_OP_ISETPC:
+                dst = _VM_LINK_AT(i + 1) | (is_word ? (_VM_LINK_AT(i + 2) << 8) : 0);
+                break;
+
+            default:
+                continue;
+        }
+
+        if(dst >= len || !(starts[dst >> 3] & (1 << (dst & 7)))) return i;
+    }
+
+    return VM_LINK_OK;
+}
+
+#undef _VM_LINK_AT
+
+
+// Places the hlt sentinel after the program in imem and links it. With CFG_VM_COMPRESSED imem
+// holds an image, which is verified first, and imem_len becomes the length of its bytecode
+static unsigned short _vm_link_program(byte* imem, unsigned short& imem_len, volatile unsigned short* ivec,
+                                       volatile unsigned short* ctx_entry, volatile byte* ctx_outs){
+    imem[imem_len] = VM_OP_STOP;
+
+  #if CFG_VM_COMPRESSED
+    imem_len = _vm_z_check(imem, imem_len);
+
+    // Fails at 0, and runs (halts) like an empty program
+    if(imem_len == VM_Z_BAD){
+        imem_len = 0;
+        return 0;
+    }
+  #endif
+
+    return _vm_link(imem, imem_len, ivec, ctx_entry, ctx_outs);
+}
+
+
+#if CFG_VM_ENGINE == 1
+static bool _vm_predecode(volatile vm_state_t& vm);
+#endif
+
+// Resets the execution state, vm.imem must be already linked
+static void _vm_reset_state(volatile vm_state_t& vm){
+    // No interrupt, and the requests for the previous program are discarded
+    vm.int_req      = VM_INT_NONE;
+    vm.irq_tail     = vm.irq_head;
+    vm.irq_overflow = 0;
 
     // Reset registers
     for(byte i = 0;i < 4;i++){
@@ -22,9 +353,101 @@ void vm_reset(volatile vm_state_t& vm, byte* imem){
         vm.saved_outs.w[i] = 0;
     }
 
-    // Reset the program counter
+    // Reset the program counter and the call stack
     vm.pc = 0;
     vm.saved_pc = 0;
+    vm.call_sp = 0;
+    vm.saved_call_sp = 0;
+
+    vm.preempt_cnt = 0;
+
+    // No fades, no wtn
+    for(byte i = 0;i < 3;i++) vm.fade_left[i] = 0;
+    vm.fade_wait = false;
+    vm.wait_left = 0;
+
+    // Contexts, from the tables built by the link pass. 0 runs first
+    vm.ctx_cur    = 0;
+    vm.ctx_first  = 0;
+    vm.ctx_active = 1;
+    vm.ctx_halted = 0;
+
+    for(byte c = 1;c < VM_CONTEXTS;c++){
+        if(vm.ctx_entry[c] == VM_IVEC_NONE) continue;
+
+        vm.ctx_active |= 1 << c;
+
+        volatile vm_context_t& ctx = vm.ctx[c - 1];
+
+        for(byte i = 0;i < 4;i++) ctx.regs.w[i] = 0;
+        ctx.pc        = vm.ctx_entry[c];
+        ctx.call_sp   = 0;
+        ctx.wait_left = 0;
+        ctx.fade_wait = false;
+    }
+
+    // Set by the caller after predecoding
+    vm.pdec = false;
+}
+
+// Link tables of a program which doesn't run (failed the verification)
+static void _vm_clear_tables(volatile unsigned short* ivec, volatile unsigned short* ctx_entry, volatile byte* ctx_outs){
+    for(byte i = 0;i < 4;i++) ivec[i] = VM_IVEC_NONE;
+
+    for(byte i = 1;i < VM_CONTEXTS;i++){
+        ctx_entry[i] = VM_IVEC_NONE;
+        ctx_outs[i]  = 0;
+    }
+
+    ctx_outs[0] = 0x0f;
+}
+
+
+unsigned short vm_reset(volatile vm_state_t& vm, byte* imem, unsigned short imem_len){
+    // Initially paused
+    vm.is_paused  = 1;
+    vm.switch_req = false;
+
+    vm.native = NULL;
+
+    unsigned short link_res = _vm_link_program(imem, imem_len, vm.ivec, vm.ctx_entry, vm.ctx_outs);
+
+    // Program memory, with the hlt sentinel
+    vm.imem     = imem;
+    vm.imem_len = imem_len;
+
+  #if CFG_VM_COMPRESSED
+    _vm_z_flush();
+  #endif
+
+    if(link_res != VM_LINK_OK) _vm_clear_tables(vm.ivec, vm.ctx_entry, vm.ctx_outs);
+
+    _vm_reset_state(vm);
+
+    // Start from the sentinel, so the program halts right away
+    if(link_res != VM_LINK_OK) vm.pc = imem_len;
+
+  #if CFG_VM_ENGINE == 1
+    vm.pdec = link_res == VM_LINK_OK && _vm_predecode(vm);
+  #endif
+
+    return link_res;
+}
+
+
+unsigned short vm_switch_program(volatile vm_state_t& vm, byte* imem, unsigned short imem_len){
+    unsigned short link_res = _vm_link_program(imem, imem_len, vm.next_ivec, vm.next_ctx_entry, vm.next_ctx_outs);
+    if(link_res != VM_LINK_OK) return link_res;
+
+    vm.next_imem     = imem;
+    vm.next_imem_len = imem_len;
+    vm.next_native   = NULL;
+
+    // vm_step does the rest on the next tick
+    vm.switch_req = true;
+    while(vm.switch_req) delay(1);
+
+    return VM_LINK_OK;
 }
 
 
@@ -38,13 +461,52 @@ void vm_set_pause(volatile vm_state_t& vm, bool pause){
 }
 
 
-void vm_request_interrupt(volatile vm_state_t& vm, byte ivect, unsigned short arg){
-    if(vm.int_req != VM_INT_NONE) return;
+static const byte _vm_irq_policy[4] = {
+    CFG_VM_IRQ_POLICY_0, CFG_VM_IRQ_POLICY_1, CFG_VM_IRQ_POLICY_2, CFG_VM_IRQ_POLICY_3
+};
+
+bool vm_request_interrupt(volatile vm_state_t& vm, byte ivect, unsigned short arg){
+    if(ivect > 3) return false;
 
-    vm.int_vector = ivect;
-    vm.int_arg    = arg;
+    byte head = vm.irq_head;
 
-    vm.int_req = VM_INT_PENDING;
+    switch(_vm_irq_policy[ivect]){
+        case VM_IRQ_DROP:
+            if(vm.int_req != VM_INT_NONE || head != vm.irq_tail) return false;
+            break;
+
+        case VM_IRQ_COALESCE: {
+            // The consumer could be popping the entry, keep it out while it's updated
+            bool merged = false;
+
+            noInterrupts();
+            for(byte i = vm.irq_tail;i != head;i = (i + 1) & (VM_IRQ_QUEUE_LEN - 1)){
+                if(vm.irq_queue[i].vector == ivect){
+                    vm.irq_queue[i].arg = arg;
+                    merged = true;
+                }
+            }
+            interrupts();
+
+            if(merged) return true;
+            break;
+        }
+    }
+
+    byte next = (head + 1) & (VM_IRQ_QUEUE_LEN - 1);
+
+    if(next == vm.irq_tail){
+        if(vm.irq_overflow != 0xffff) vm.irq_overflow++;
+        return false;
+    }
+
+    vm.irq_queue[head].vector = ivect;
+    vm.irq_queue[head].arg    = arg;
+
+    // Publish the entry
+    vm.irq_head = next;
+
+    return true;
 }
 
 
@@ -56,22 +518,581 @@ static inline void _vm_copy_regs(volatile vm_regs_t& dst, volatile vm_regs_t& sr
     dst.w[3] = src.w[3];
 }
 
-void vm_step(volatile vm_state_t& vm, bool debug){
-    // Pause and debug check because the debug mode is intended
-    // to be used with the VM paused
-    if(vm.is_paused && !debug){
-        vm.is_paused_ack = true;
-        return;
+// Starts a fade of the oreg ro from its current value. Returns the new value of the oreg
+static unsigned short _vm_fade_set(volatile vm_state_t& vm, byte ro, unsigned short target, unsigned short ticks, unsigned short from){
+    vm.fade_target[ro] = target;
+    vm.fade_left[ro]   = ticks;
+
+    if(!ticks) return target;
+
+    vm.fade_acc[ro]    = (long)from << 8;
+    vm.fade_step[ro]   = ((long)target - from) * 256 / ticks;
+
+    return from;
+}
+
+// Starts the fade encoded by the 'fd' instruction at inst, from the current value of
+// the oreg. Returns the new value of the oreg
+static unsigned short _vm_fade_start(volatile vm_state_t& vm, const byte* inst, unsigned short from){
+    byte ro = (inst[0] >> 4) & 3;
+    unsigned short target, ticks;
+
+    if(inst[0] >> 7){
+        target = inst[1] | (inst[2] << 8);
+        inst += 3;
+    } else {
+        target = inst[1] << 8;
+        inst += 2;
     }
-    
-    vm.is_paused_ack = 0;
-    
+
+    ticks = inst[0] | (inst[1] << 8);
+
+    return _vm_fade_set(vm, ro, target, ticks, from);
+}
+
+// True if an oreg of the running context is fading
+static inline bool _vm_fading(volatile vm_state_t& vm){
+    byte outs = vm.ctx_outs[vm.ctx_cur];
+
+    return ((outs & 1) && vm.fade_left[0]) || ((outs & 2) && vm.fade_left[1]) || ((outs & 4) && vm.fade_left[2]);
+}
+
+// Advances the fades by a tick, returns the mask of the ones which ran
+static byte _vm_fade_tick(volatile vm_state_t& vm){
+    byte ran = 0;
+
+    for(byte i = 0;i < 3;i++){
+        if(!vm.fade_left[i]) continue;
+
+        // The last step lands exactly on the target
+        if(--vm.fade_left[i]){
+            vm.fade_acc[i] += vm.fade_step[i];
+            vm.outs.w[i]    = vm.fade_acc[i] >> 8;
+        } else {
+            vm.outs.w[i]    = vm.fade_target[i];
+        }
+
+        ran |= 1 << i;
+    }
+
+    return ran;
+}
+
+// iret and isetpc work only in context 0, which services the interrupts
+static inline bool _vm_in_interrupt(volatile vm_state_t& vm){
+    return vm.int_req == VM_INT_ONGOING && !vm.ctx_cur;
+}
+
+// Swaps the running state with the one saved in context c (1..VM_CONTEXTS - 1),
+// a second call swaps it back
+static void _vm_ctx_swap(volatile vm_state_t& vm, byte c){
+    volatile vm_context_t& ctx = vm.ctx[c - 1];
+
+    unsigned short tmpw;
+    byte           tmp;
+
+    for(byte i = 0;i < 4;i++){
+        tmpw = vm.regs.w[i]; vm.regs.w[i] = ctx.regs.w[i]; ctx.regs.w[i] = tmpw;
+    }
+
+    tmpw = vm.pc; vm.pc = ctx.pc; ctx.pc = tmpw;
+
+    for(byte i = 0;i < VM_CALL_DEPTH;i++){
+        tmpw = vm.call_stack[i]; vm.call_stack[i] = ctx.call_stack[i]; ctx.call_stack[i] = tmpw;
+    }
+
+    tmp  = vm.call_sp;   vm.call_sp   = ctx.call_sp;   ctx.call_sp   = tmp;
+    tmpw = vm.wait_left; vm.wait_left = ctx.wait_left; ctx.wait_left = tmpw;
+    tmp  = vm.fade_wait; vm.fade_wait = ctx.fade_wait; ctx.fade_wait = tmp;
+}
+
+// Register operation (VM_OP_XOP) on dst, data is (vm_xop_e << 4) | src. Returns what it costs
+// on top of its instruction, in instructions of the tick budget (the pixel operations, see vm.h)
+static inline byte _vm_xop(byte dst, byte data, vm_regs_t& regs, vm_regs_t& outs){
+    byte src = data & 0x0f;
+
+  #if CFG_STRIP_PIXELS
+    // The colour of the pixel operations
+    byte rgb[3] = {(byte)(outs.w[0] >> 8), (byte)(outs.w[1] >> 8), (byte)(outs.w[2] >> 8)};
+  #endif
+
+    switch(data >> 4){
+        case VM_XOP_MOV:    regs.w[dst]  = regs.w[src]; break;
+        case VM_XOP_ADD:    regs.w[dst] += regs.w[src]; break;
+        case VM_XOP_SUB:    regs.w[dst] -= regs.w[src]; break;
+        case VM_XOP_SETOUT: outs.w[dst]  = regs.w[src]; break;
+        case VM_XOP_GETOUT: regs.w[dst]  = outs.w[src]; break;
+        case VM_XOP_MODOUT: outs.w[dst] += regs.w[src]; break;
+
+      #if CFG_STRIP_PIXELS
+        case VM_XOP_PFILL:  strip_fill(regs.w[dst], regs.w[src], rgb); return CFG_STRIP_PIXELS / 2;
+        case VM_XOP_PGRAD:  strip_grad(regs.w[dst], regs.w[src]);      return CFG_STRIP_PIXELS;
+        case VM_XOP_PROT:   strip_rotate(regs.w[dst]);                 return CFG_STRIP_PIXELS;
+        case VM_XOP_PSHIFT: strip_shift(regs.w[dst], rgb);             return CFG_STRIP_PIXELS / 2;
+        case VM_XOP_PSCALE: strip_scale(regs.w[dst]);                  return CFG_STRIP_PIXELS * 3;
+        case VM_XOP_PFADE:  strip_fade(regs.w[dst], rgb);              return CFG_STRIP_PIXELS * 2;
+
+        case VM_XOP_PGET:
+            strip_get(regs.w[dst], rgb);
+
+            for(byte i = 0;i < 3;i++) outs.w[i] = (unsigned short)rgb[i] << 8;
+            break;
+      #endif
+    }
+
+    return 0;
+}
+
+// cmt: latches the oregs of the running context, and marks the strip's frame as due
+static inline void _vm_commit(volatile vm_state_t& vm, vm_regs_t& outs){
+    output_commit(outs.w[0], outs.w[1], outs.w[2], vm.ctx_outs[vm.ctx_cur]);
+
+  #if CFG_STRIP_PIXELS
+    strip_commit();
+  #endif
+}
+
+static void _vm_debug_dump(volatile vm_state_t& vm){
+    if(!CFG_DO_DEBUG) return;
+
+    PR(F("int_mode ")); PR(vm.int_req);
+    PR(F(" queued ")); PR((vm.irq_head - vm.irq_tail) & (VM_IRQ_QUEUE_LEN - 1));
+    PR(F(" overflow ")); PLN(vm.irq_overflow);
+
+    PR(F("regs"));
+    PR(F(" ")); PR(vm.regs.w[0], HEX);
+    PR(F(" ")); PR(vm.regs.w[1], HEX);
+    PR(F(" ")); PR(vm.regs.w[2], HEX);
+    PR(F(" ")); PLN(vm.regs.w[3], HEX);
+
+    PR(F("outs"));
+    PR(F(" ")); PR(vm.outs.w[0], HEX);
+    PR(F(" ")); PR(vm.outs.w[1], HEX);
+    PR(F(" ")); PLN(vm.outs.w[2], HEX);
+
+    PR(F("fades"));
+    PR(F(" ")); PR(vm.fade_left[0]);
+    PR(F(" ")); PR(vm.fade_left[1]);
+    PR(F(" ")); PR(vm.fade_left[2]);
+    PR(F(" wait ")); PLN(vm.fade_wait);
+
+    PR(F("wtn ")); PLN(vm.wait_left);
+
+    PR(F("call sp ")); PLN(vm.call_sp);
+
+    PR(F("ctx ")); PR(vm.ctx_cur);
+    PR(F(" halted ")); PLN(vm.ctx_halted, HEX);
+
+    PR(F("preempt ")); PLN(vm.preempt_cnt);
+}
+
+
+#if CFG_VM_ENGINE == 1
+/*
+    Predecoded engine
+
+    At link time the bytecode is translated to an array of vm_pinst_t: one entry per instruction,
+    with the operand already widened to 16 bits (so, for example, 'sob @R, 1' has 0x0100 as .arg)
+    and the jump/isetpc destinations resolved to instruction indices ('fd' keeps its imem address, as it has two operands). While this engine runs
+    a program vm.pc, vm.saved_pc, vm.ivec and the contexts' pc and entry hold instruction indices instead of imem addresses.
+    The array ends with a 'hlt' sentinel, like imem
+*/
+
+typedef struct {
+    byte           op;   // vm_opcode_e (VM_OP_JMPABS is translated to VM_OP_JMP)
+    byte           ro;   // reg/oreg index
+    unsigned short arg;  // widened operand or destination index
+} vm_pinst_t;
+
+static vm_pinst_t _vm_pdec[CFG_VM_PDEC_LEN];
+
+// Index of the instruction at addr (a verified instruction boundary). starts is the bitmap
+// of the instruction boundaries, before[g] the number of instructions before address g * 8
+static byte _vm_pdec_index(byte* starts, byte* before, unsigned short addr){
+    byte n    = before[addr >> 3];
+    byte bits = starts[addr >> 3] & ((1 << (addr & 7)) - 1);
+
+    for(;bits;bits &= bits - 1) n++;
+
+    return n;
+}
+
+// Translates a linked program, returns false if it doesn't fit in _vm_pdec.
+// This runs in constant time per instruction, as programs are switched inside the tick
+static bool _vm_predecode(volatile vm_state_t& vm){
+    byte* imem = vm.imem;
+    byte  n = 0, g = 0;
+    unsigned short i;
+
+    byte starts[MAX_PROG_LEN / 8];
+    byte before[MAX_PROG_LEN / 8];
+
+    for(i = 0;i < sizeof(starts);i++) starts[i] = 0;
+
+    for(i = 0;i < vm.imem_len;i += _vm_inst_len(imem[i])){
+        // Keep room for the sentinel
+        if(n >= CFG_VM_PDEC_LEN - 1) return false;
+
+        starts[i >> 3] |= 1 << (i & 7);
+        while((g << 3) <= i) before[g++] = n;
+
+        n++;
+    }
+
+    n = 0;
+
+    for(i = 0;i < vm.imem_len;i += _vm_inst_len(imem[i])){
+        vm_pinst_t& pi = _vm_pdec[n++];
+
+        byte is_word = imem[i] >> 7;
+        unsigned short next = i + _vm_inst_len(imem[i]);
+
+        pi.op  = imem[i] & 0B00001111;
+        pi.ro  = (imem[i] >> 4) & 3;
+        pi.arg = 0;
+
+        switch(pi.op){
+            case VM_OP_SETREG:
+                pi.arg = is_word ? imem[i + 1] | (imem[i + 2] << 8) : imem[i + 1];
+                break;
+
+            case VM_OP_SETOUT:
+                pi.arg = is_word ? imem[i + 1] | (imem[i + 2] << 8) : imem[i + 1] << 8;
+                break;
+
+            case VM_OP_MODOUT:
+                pi.arg = is_word ? imem[i + 1] | (imem[i + 2] << 8) : (signed char)imem[i + 1];
+                break;
+
+            case VM_OP_WAITN:
+                pi.arg = is_word ? imem[i + 1] | (imem[i + 2] << 8) : imem[i + 1];
+                break;
+
+            case VM_OP_DRJNZ:
+                if(is_word) pi.arg = next + (signed short)(imem[i + 1] | (imem[i + 2] << 8));
+                else        pi.arg = next + (signed char)imem[i + 1];
+                pi.arg = _vm_pdec_index(starts, before, pi.arg);
+                break;
+
+            case VM_OP_JMP:
+                pi.arg = _vm_pdec_index(starts, before, next + (signed char)imem[i + 1]);
+                break;
+
+            case VM_OP_JMPABS:
+                pi.op  = VM_OP_JMP;
+                // fall through
+            case VM_OP_ISETPC:
+                pi.arg = _vm_pdec_index(starts, before, imem[i + 1] | (is_word ? (imem[i + 2] << 8) : 0));
+                break;
+
+            case VM_OP_FADE:
+                pi.arg = i;
+                break;
+
+            case VM_OP_CALL:
+                if(pi.ro == VM_CALL_CALL) pi.arg = _vm_pdec_index(starts, before, imem[i + 1] | (is_word ? (imem[i + 2] << 8) : 0));
+                break;
+
+            case VM_OP_XOP:
+                pi.arg = imem[i + 1];
+                break;
+        }
+    }
+
+    _vm_pdec[n].op = VM_OP_STOP;
+
+    for(byte v = 0;v < 4;v++){
+        if(vm.ivec[v] != VM_IVEC_NONE) vm.ivec[v] = _vm_pdec_index(starts, before, vm.ivec[v]);
+    }
+
+    // The contexts haven't run yet, they start from their entry
+    for(byte c = 1;c < VM_CONTEXTS;c++){
+        if(vm.ctx_entry[c] == VM_IVEC_NONE) continue;
+
+        vm.ctx_entry[c]  = _vm_pdec_index(starts, before, vm.ctx_entry[c]);
+        vm.ctx[c - 1].pc = vm.ctx_entry[c];
+    }
+
+    return true;
+}
+
+// Runs the predecoded program until an hlt, cmt, wt or after budget instructions. The program counter and the
+// registers live in locals and are written back to vm only when the VM yields.
+// Returns the number of instructions executed
+static unsigned short _vm_run_pdec(volatile vm_state_t& vm, bool debug, unsigned short budget){
+    // Indexed by vm_opcode_e
+    static const void* const dispatch[] = {
+        &&op_stop, &&op_setreg, &&op_setout, &&op_modout, &&op_commit, &&op_wait,
+        &&op_drjnz, &&op_jmp, &&op_stop, &&op_nop, &&op_isetpc, &&op_iret,
+        &&op_fade, &&op_waitn, &&op_call, &&op_xop
+    };
+
+    const vm_pinst_t* pi;
+    byte      pc = vm.pc;
+    unsigned short n = 1;
+    vm_regs_t regs, outs;
+
+    for(byte i = 0;i < 4;i++){
+        regs.w[i] = vm.regs.w[i];
+        outs.w[i] = vm.outs.w[i];
+    }
+
+    // In debug mode only a single instruction is executed
+    #if CFG_VM_TICK_BUDGET
+        #define PDEC_CHECK_BUDGET() if(n >= budget) goto _preempt
+    #else
+        #define PDEC_CHECK_BUDGET()
+    #endif
+
+    #define PDEC_NEXT() do {                 \
+        if(debug) goto _debug_out;           \
+        PDEC_CHECK_BUDGET();                 \
+        pi = &_vm_pdec[pc++];                \
+        n++;                                 \
+        goto *dispatch[pi->op];              \
+    } while(0)
+
+  #if CFG_VM_TICK_BUDGET
+    // The contexts before this one used the whole tick
+    if(!budget){
+        pi = &_vm_pdec[pc];
+        n  = 0;
+        goto _preempt;
+    }
+  #endif
+
+    pi = &_vm_pdec[pc++];
+    goto *dispatch[pi->op];
+
+  op_setreg:
+    regs.w[pi->ro] = pi->arg;
+    PDEC_NEXT();
+
+  op_setout:
+    outs.w[pi->ro] = pi->arg;
+    PDEC_NEXT();
+
+  op_modout:
+    outs.w[pi->ro] += pi->arg;
+    PDEC_NEXT();
+
+  op_drjnz:
+    if(--regs.w[pi->ro]) pc = pi->arg;
+    PDEC_NEXT();
+
+  op_jmp:
+    pc = pi->arg;
+    PDEC_NEXT();
+
+  op_nop:
+    PDEC_NEXT();
+
+  op_isetpc:
+    if(_vm_in_interrupt(vm)){
+        vm.saved_pc      = pi->arg;
+        vm.saved_call_sp = 0;
+    }
+    PDEC_NEXT();
+
+  op_iret:
+    if(_vm_in_interrupt(vm)){
+        for(byte i = 0;i < 4;i++){
+            regs.w[i] = vm.saved_regs.w[i];
+            if(vm.ctx_outs[0] & (1 << i)) outs.w[i] = vm.saved_outs.w[i];
+        }
+        pc = vm.saved_pc;
+        vm.call_sp = vm.saved_call_sp;
+
+        vm.int_req = VM_INT_NONE;
+    }
+    PDEC_NEXT();
+
+  op_call:
+    if(pi->ro == VM_CALL_CALL){
+        if(vm.call_sp == VM_CALL_DEPTH) goto op_stop;
+
+        vm.call_stack[vm.call_sp++] = pc;
+        pc = pi->arg;
+    } else {
+        if(!vm.call_sp) goto op_stop;
+
+        pc = vm.call_stack[--vm.call_sp];
+    }
+    PDEC_NEXT();
+
+  op_xop:
+    n += _vm_xop(pi->ro, pi->arg, regs, outs);
+    PDEC_NEXT();
+
+  op_fade:
+    if(pi->ro != VM_FADE_WAIT){
+        outs.w[pi->ro] = _vm_fade_start(vm, &vm.imem[pi->arg], outs.w[pi->ro]);
+    } else if(_vm_fading(vm)){
+        vm.fade_wait = true;
+        goto _yield;
+    }
+    PDEC_NEXT();
+
+  op_waitn:
+    if(pi->arg){
+        vm.wait_left = pi->arg - 1;
+        goto _yield;
+    }
+    PDEC_NEXT();
+
+  op_stop:
+    vm.is_paused = true;
+    goto _yield;
+
+  op_commit:
+    _vm_commit(vm, outs);
+    goto _yield;
+
+  op_wait:
+    goto _yield;
+
+    #undef PDEC_NEXT
+    #undef PDEC_CHECK_BUDGET
+
+  #if CFG_VM_TICK_BUDGET
+  _preempt:
+    vm.preempted = true;
+  #endif
+
+  _debug_out:
+  _yield:
+    vm.pc = pc;
+
+    for(byte i = 0;i < 4;i++){
+        vm.regs.w[i] = regs.w[i];
+        vm.outs.w[i] = outs.w[i];
+    }
+
+    if(debug && CFG_DO_DEBUG){
+        PR(F("pdec op "));
+        PR(pi->op);
+        PR(F(" ro "));
+        PR(pi->ro);
+        PR(F(" arg "));
+        PLN(pi->arg);
+
+        _vm_debug_dump(vm);
+    }
+
+    return n;
+}
+#endif
+
+#if CFG_VM_BUILTINS
+/*
+    Built-in programs
+
+    lspvm-asm/lspaot translates verified programs to builtins.h: one function per program, which runs it for a tick
+    the same way the classic interpreter does. vm.pc still holds imem addresses: the function switches on it, jumps
+    straight to its own labels and saves it where the program yields (or is preempted), so the interrupt vectors, the
+    call stack and the contexts work unchanged. The regs live in locals, like in _vm_run_pdec.
+    The generated code uses the macros and the helpers below
+*/
+
+typedef struct {
+    vm_native_t    run;
+    unsigned short ivec[4];
+    unsigned short ctx_entry[VM_CONTEXTS];
+    byte           ctx_outs[VM_CONTEXTS];
+} vm_builtin_t;
+
+// Ends the tick, the program resumes from addr
+#define VM_NATIVE_YIELD(addr) do { pc = (addr); goto _yield; } while(0)
+
+// Start of the instruction at addr: preemption at the end of the tick budget and single step in debug mode
+#if CFG_VM_TICK_BUDGET
+    #define VM_NATIVE_BUDGET(addr) if(n >= budget){ vm.preempted = true; VM_NATIVE_YIELD(addr); }
+#else
+    #define VM_NATIVE_BUDGET(addr)
+#endif
+
+#define VM_NATIVE_INST(addr) VM_NATIVE_BUDGET(addr); if(debug && n) VM_NATIVE_YIELD(addr); n++
+
+static inline void _vm_native_load(volatile vm_state_t& vm, vm_regs_t& regs, vm_regs_t& outs){
+    for(byte i = 0;i < 4;i++){
+        regs.w[i] = vm.regs.w[i];
+        outs.w[i] = vm.outs.w[i];
+    }
+}
+
+static inline void _vm_native_store(volatile vm_state_t& vm, vm_regs_t& regs, vm_regs_t& outs, unsigned short pc){
+    vm.pc = pc;
+
+    for(byte i = 0;i < 4;i++){
+        vm.regs.w[i] = regs.w[i];
+        vm.outs.w[i] = outs.w[i];
+    }
+}
+
+// iret inside an interrupt, returns the pc to resume from
+static inline unsigned short _vm_native_iret(volatile vm_state_t& vm, vm_regs_t& regs, vm_regs_t& outs){
+    for(byte i = 0;i < 4;i++){
+        regs.w[i] = vm.saved_regs.w[i];
+        if(vm.ctx_outs[0] & (1 << i)) outs.w[i] = vm.saved_outs.w[i];
+    }
+
+    vm.call_sp = vm.saved_call_sp;
+    vm.int_req = VM_INT_NONE;
+
+    return vm.saved_pc;
+}
+
+#include "builtins.h"
+
+bool vm_switch_builtin(volatile vm_state_t& vm, byte n){
+    if(n >= VM_BUILTINS) return false;
+
+    const vm_builtin_t& b = _vm_builtins[n];
+
+    for(byte i = 0;i < 4;i++) vm.next_ivec[i] = b.ivec[i];
+
+    for(byte i = 0;i < VM_CONTEXTS;i++){
+        vm.next_ctx_entry[i] = b.ctx_entry[i];
+        vm.next_ctx_outs[i]  = b.ctx_outs[i];
+    }
+
+    // No imem: nothing reads it while a built-in program runs
+    vm.next_imem     = NULL;
+    vm.next_imem_len = 0;
+    vm.next_native   = b.run;
+
+    // vm_step does the rest on the next tick
+    vm.switch_req = true;
+    while(vm.switch_req) delay(1);
+
+    return true;
+}
+
+byte vm_builtin_count(){
+    return VM_BUILTINS;
+}
+#else
+bool vm_switch_builtin(volatile vm_state_t& vm, byte n){
+    return false;
+}
+
+byte vm_builtin_count(){
+    return 0;
+}
+#endif
+
+// Runs the current context (vm.ctx_cur) for a tick, with budget instructions left in it (see CFG_VM_TICK_BUDGET).
+// Returns the number of instructions executed
+static unsigned short _vm_run(volatile vm_state_t& vm, bool debug, unsigned short budget){
     register byte op_is_word;
     register byte op_ro;
     register byte op_ro_b;  // byte offset, that is op_ro << 1, to address vm_regs_t.b
 
     register          byte  tmp;
     register unsigned short tmpw;
+
+    // Instructions executed
+    unsigned short n = 0;
     
     static union {
         unsigned char ub[2];
@@ -79,68 +1100,45 @@ void vm_step(volatile vm_state_t& vm, bool debug){
           signed short w;
     } stmp;
 
-    // Check pending interrupts
-    if(vm.int_req == VM_INT_PENDING){
-        // Search for the vector
-        byte int_entry = (vm.int_vector << 4) | VM_OP_IVEC;
-        unsigned short i;
-
-        bool enter_interrupt = false;
-        
-        for(i = 0;i < MAX_PROG_LEN;i++){
-            if(vm.imem[i] == int_entry){
-                enter_interrupt = true;
-                break;
-            }
-
-            // Skip instruction's data
-            switch(vm.imem[i] & 0B00001111){
-                // No data
-                case VM_OP_STOP:
-                case VM_OP_COMMIT:
-                case VM_OP_WAIT:
-                case VM_OP_IVEC:
-                case VM_OP_IRET:
-                    i += 0;
-                    break;
-
-                // A single byte
-                case VM_OP_JMP:
-                    i += 1;
-                    break;
-
-                // Depends on is_word
-                default:
-                    i += (vm.imem[i] >> 7) ? 2 : 1;
-                    break;
-            }
+    // fwt
+    if(vm.fade_wait){
+        if(_vm_fading(vm)){
+            if(debug && CFG_DO_DEBUG) _vm_debug_dump(vm);
+            return 0;
         }
 
-        if(enter_interrupt){
-            // Save regs and current program counter
-            _vm_copy_regs(vm.saved_regs, vm.regs);
-            _vm_copy_regs(vm.saved_outs, vm.outs);
-            vm.saved_pc   = vm.pc;
-
-            // Set %A
-            vm.regs.w[0] = vm.int_arg;
+        vm.fade_wait = false;
+    }
 
-            // Jump to the interrupt
-            vm.pc = i;
-            
-            vm.int_req = VM_INT_ONGOING;
-        } else {
-            if(debug && CFG_DO_DEBUG){
-                PLN("Requested interrupt but no vector found");
-            }
-            
-            vm.int_req = VM_INT_NONE;
-        }
+    // wtn, sleeping
+    if(vm.wait_left){
+        vm.wait_left--;
+        return 0;
     }
 
-    // Run the VM until an hlt, cmt or wt instruction are executed
+  #if CFG_VM_BUILTINS
+    if(vm.native) return vm.native(vm, debug, budget);
+  #endif
+
+  #if CFG_VM_ENGINE == 1
+    if(vm.pdec) return _vm_run_pdec(vm, debug, budget);
+  #endif
+
+    // Run the VM until an hlt, cmt or wt instruction are executed,
+    // or until it runs out of the instruction budget
     while(true){
-        tmp = vm.imem[vm.pc++];
+      #if CFG_VM_TICK_BUDGET
+        // Out of time for this tick, resume from here on the next one
+        if(n >= budget){
+            vm.preempted = true;
+            return n;
+        }
+      #endif
+
+        tmp = VM_FETCH(vm.pc++);
+        n++;
+
+        VM_PROFILE_INST(tmp);
 
         op_is_word =  tmp >> 7;
         op_ro      = (tmp >> 4) & 3;
@@ -150,113 +1148,102 @@ void vm_step(volatile vm_state_t& vm, bool debug){
             case VM_OP_STOP:
                 vm.is_paused = true;
 
-                if(debug && CFG_DO_DEBUG) PLN("VM_OP_STOP");
-                return;
+                if(debug && CFG_DO_DEBUG) PLN(F("VM_OP_STOP"));
+                return n;
 
             case VM_OP_SETREG:
                 // LSB
-                vm.regs.b[op_ro_b + 0] = vm.imem[vm.pc++];
+                vm.regs.b[op_ro_b + 0] = VM_FETCH(vm.pc++);
                 // MSB
-                tmp = op_is_word ? vm.imem[vm.pc++] : 0;
+                tmp = op_is_word ? VM_FETCH(vm.pc++) : 0;
                 vm.regs.b[op_ro_b + 1] = tmp;
 
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_SETREG@");
+                    PR(F("VM_OP_SETREG@"));
                     PR(op_is_word ? "16" : "8");
-                    PR(" reg ");
+                    PR(F(" reg "));
                     PR(op_ro);
-                    PR(" = ");
+                    PR(F(" = "));
                     PLN(vm.regs.w[op_ro]);
                 }
                 break;
 
             case VM_OP_SETOUT:
-                vm.outs.b[op_ro_b + 0] = op_is_word ? vm.imem[vm.pc++] : 0;
-                vm.outs.b[op_ro_b + 1] = vm.imem[vm.pc++];
+                vm.outs.b[op_ro_b + 0] = op_is_word ? VM_FETCH(vm.pc++) : 0;
+                vm.outs.b[op_ro_b + 1] = VM_FETCH(vm.pc++);
 
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_SETOUT@");
+                    PR(F("VM_OP_SETOUT@"));
                     PR(op_is_word ? "16" : "8");
-                    PR(" out ");
+                    PR(F(" out "));
                     PR(op_ro);
-                    PR(" = ");
+                    PR(F(" = "));
                     PLN(vm.outs.w[op_ro]);
                 }
                 break;
 
             case VM_OP_MODOUT:
-                stmp.ub[0] = vm.imem[vm.pc++];
+                stmp.ub[0] = VM_FETCH(vm.pc++);
                 
                 if(op_is_word){
-                    stmp.ub[1] = vm.imem[vm.pc++];
+                    stmp.ub[1] = VM_FETCH(vm.pc++);
                     vm.outs.w[op_ro] += stmp.w;
                 } else {
                     vm.outs.w[op_ro] += stmp.b;
                 }
                 
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_MODOUT@");
+                    PR(F("VM_OP_MODOUT@"));
                     PR(op_is_word ? "16" : "8");
-                    PR(" reg ");
+                    PR(F(" reg "));
                     PR(op_ro);
-                    PR(" += ");
+                    PR(F(" += "));
                     PLN(op_is_word ? stmp.w : stmp.b);
                 }
                 break;
 
             case VM_OP_COMMIT: {
-                extern unsigned short brightness;
-                  
-                tmpw  = vm.outs.b[1];  // MSB of vm.outs.w[0]
-                tmpw *= brightness >> 8;
-                OCR0A = tmpw >> 8;
-                
-                tmpw  = vm.outs.b[3];  // MSB of .w[1]
-                tmpw *= brightness >> 8;
-                OCR0B = tmpw >> 8;
-                
-                tmpw  = vm.outs.b[5];  // .w[2]
-                tmpw *= brightness >> 8;
-                OCR2A = tmpw >> 8;
+                // MSBs of .w[0], .w[1] and .w[2]
+                _vm_commit(vm, (vm_regs_t&)vm.outs);
                 
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_COMMIT RGB ");
-                    PR(vm.outs.b[1]); PR(" ");
-                    PR(vm.outs.b[3]); PR(" ");
+                    PR(F("VM_OP_COMMIT RGB "));
+                    PR(vm.outs.b[1]); PR(F(" "));
+                    PR(vm.outs.b[3]); PR(F(" "));
                     PLN(vm.outs.b[5]);
                 }
-                return;
+                return n;
             }
 
             case VM_OP_WAIT:
-                if(debug && CFG_DO_DEBUG) PLN("VM_OP_WAIT");
-                return;
+                if(debug && CFG_DO_DEBUG) PLN(F("VM_OP_WAIT"));
+                return n;
 
             case VM_OP_DRJNZ:
                 vm.regs.w[op_ro]--;
                 
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_DRJNZ@");
+                    PR(F("VM_OP_DRJNZ@"));
                     PR(op_is_word ? "16" : "8");
-                    PR(" reg ");
+                    PR(F(" reg "));
                     PR(op_ro);
-                    PR(" jmp to ");
-                    stmp.ub[0] = vm.imem[vm.pc + 0];
+                    PR(F(" jmp to "));
+                    stmp.ub[0] = VM_FETCH(vm.pc + 0);
                     if(op_is_word){
-                        stmp.ub[1] = vm.imem[vm.pc + 1];
+                        stmp.ub[1] = VM_FETCH(vm.pc + 1);
                         PR(stmp.w);
                     } else {
                         PR(stmp.b);
                     }
-                    if(vm.regs.w[op_ro] == 0) PR(" cont");
+                    if(vm.regs.w[op_ro] == 0) PR(F(" cont"));
                     PLN();
                 }
                 
                 if(vm.regs.w[op_ro] != 0){
-                    stmp.ub[0] = vm.imem[vm.pc++];
+                    stmp.ub[0] = VM_FETCH(vm.pc++);
                 
                     if(op_is_word){
-                        stmp.ub[1] = vm.imem[vm.pc++];
+                        stmp.ub[1] = VM_FETCH(vm.pc++);
                         vm.pc += stmp.w;
                     } else {
                         vm.pc += stmp.b;
@@ -268,93 +1255,337 @@ void vm_step(volatile vm_state_t& vm, bool debug){
                 break;
 
             case VM_OP_JMP:
-                stmp.ub[0] = vm.imem[vm.pc++];
+                stmp.ub[0] = VM_FETCH(vm.pc++);
                 
                 vm.pc += stmp.b;
                 
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_JMP ");
-                    PR(" off ");
+                    PR(F("VM_OP_JMP "));
+                    PR(F(" off "));
                     PLN(stmp.b);
                 }
                 break;
 
             case VM_OP_JMPABS:
                 // LSB
-                tmpw = vm.imem[vm.pc++];
+                tmpw = VM_FETCH(vm.pc++);
                 // MSB
-                tmpw |= op_is_word ? (vm.imem[vm.pc] << 8) : 0;
+                tmpw |= op_is_word ? (VM_FETCH(vm.pc) << 8) : 0;
                 
                 vm.pc = tmpw;
 
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_JMPABS@");
+                    PR(F("VM_OP_JMPABS@"));
                     PR(op_is_word ? "16" : "8");
-                    PR(" dst ");
+                    PR(F(" dst "));
                     PLN(tmpw);
                 }
                 break;
 
             case VM_OP_IVEC:
+                // context, skip the oregs mask
+                if(tmp & VM_IVEC_CONTEXT) vm.pc++;
+
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_IVEC n ");
+                    PR(F("VM_OP_IVEC n "));
                     PLN(op_ro);
                 }
                 break;
 
             case VM_OP_ISETPC:
                 // LSB
-                tmpw = vm.imem[vm.pc++];
+                tmpw = VM_FETCH(vm.pc++);
                 // MSB
-                tmpw |= op_is_word ? (vm.imem[vm.pc++] << 8) : 0;
+                tmpw |= op_is_word ? (VM_FETCH(vm.pc++) << 8) : 0;
                 
-                if(vm.int_req != VM_INT_ONGOING) break;
+                if(!_vm_in_interrupt(vm)) break;
                 
                 vm.saved_pc = tmpw;
+
+                // The handler resumes somewhere else, drop the program's calls
+                vm.saved_call_sp = 0;
                 
                 if(debug && CFG_DO_DEBUG){
-                    PR("VM_OP_ISETPC@");
+                    PR(F("VM_OP_ISETPC@"));
                     PR(op_is_word ? "16" : "8");
-                    PR(" dst ");
+                    PR(F(" dst "));
                     PLN(tmpw);
                 }
                 break;
 
+            case VM_OP_WAITN:
+                // LSB
+                tmpw = VM_FETCH(vm.pc++);
+                // MSB
+                tmpw |= op_is_word ? (VM_FETCH(vm.pc++) << 8) : 0;
+
+                if(debug && CFG_DO_DEBUG){
+                    PR(F("VM_OP_WAITN@"));
+                    PR(op_is_word ? "16" : "8");
+                    PR(F(" ticks "));
+                    PLN(tmpw);
+                }
+
+                // This tick is the first one
+                if(!tmpw) break;
+
+                vm.wait_left = tmpw - 1;
+                return n;
+
+            case VM_OP_FADE:
+                if(op_ro == VM_FADE_WAIT){
+                    if(debug && CFG_DO_DEBUG) PLN(F("VM_OP_FADE wait"));
+
+                    if(!_vm_fading(vm)) break;
+
+                    vm.fade_wait = true;
+                    return n;
+                }
+
+              #if CFG_VM_COMPRESSED
+                {
+                    // Copied out of the window, the instruction can cross a block boundary
+                    byte inst[5];
+
+                    for(byte i = 0;i < 5;i++) inst[i] = VM_FETCH(vm.pc - 1 + i);
+
+                    vm.outs.w[op_ro] = _vm_fade_start(vm, inst, vm.outs.w[op_ro]);
+                }
+              #else
+                vm.outs.w[op_ro] = _vm_fade_start(vm, &vm.imem[vm.pc - 1], vm.outs.w[op_ro]);
+              #endif
+                vm.pc += (op_is_word ? 4 : 3);
+
+                if(debug && CFG_DO_DEBUG){
+                    PR(F("VM_OP_FADE@"));
+                    PR(op_is_word ? "16" : "8");
+                    PR(F(" out "));
+                    PR(op_ro);
+                    PR(F(" to "));
+                    PR(vm.fade_target[op_ro]);
+                    PR(F(" ticks "));
+                    PLN(vm.fade_left[op_ro]);
+                }
+                break;
+
+            case VM_OP_CALL:
+                if(op_ro == VM_CALL_CALL){
+                    // LSB
+                    tmpw = VM_FETCH(vm.pc++);
+                    // MSB
+                    tmpw |= op_is_word ? (VM_FETCH(vm.pc++) << 8) : 0;
+
+                    if(debug && CFG_DO_DEBUG){
+                        PR(F("VM_OP_CALL@"));
+                        PR(op_is_word ? "16" : "8");
+                        PR(F(" dst "));
+                        PLN(tmpw);
+                    }
+
+                    if(vm.call_sp == VM_CALL_DEPTH){
+                        if(debug && CFG_DO_DEBUG) PLN(F("call stack overflow"));
+
+                        vm.is_paused = true;
+                        return n;
+                    }
+
+                    vm.call_stack[vm.call_sp++] = vm.pc;
+                    vm.pc = tmpw;
+                } else {
+                    if(debug && CFG_DO_DEBUG) PLN(F("VM_OP_CALL ret"));
+
+                    if(!vm.call_sp){
+                        if(debug && CFG_DO_DEBUG) PLN(F("call stack underflow"));
+
+                        vm.is_paused = true;
+                        return n;
+                    }
+
+                    vm.pc = vm.call_stack[--vm.call_sp];
+                }
+                break;
+
+            case VM_OP_XOP:
+                tmp = VM_FETCH(vm.pc++);
+                VM_PROFILE_XOP(tmp);
+
+                // This runs in the timer interrupt, nothing else touches the registers
+                n += _vm_xop(op_ro, tmp, (vm_regs_t&)vm.regs, (vm_regs_t&)vm.outs);
+
+                if(debug && CFG_DO_DEBUG){
+                    PR(F("VM_OP_XOP "));
+                    PR(tmp >> 4);
+                    PR(F(" dst "));
+                    PR(op_ro);
+                    PR(F(" src "));
+                    PLN(tmp & 0x0f);
+                }
+                break;
+
             case VM_OP_IRET:
-                if(vm.int_req != VM_INT_ONGOING) break;
+                if(!_vm_in_interrupt(vm)) break;
                 
                 // Restore the registers and the prog counter
                 _vm_copy_regs(vm.regs, vm.saved_regs);
-                _vm_copy_regs(vm.outs, vm.saved_outs);
+
+                // The oregs of the other contexts kept running
+                for(byte i = 0;i < 4;i++){
+                    if(vm.ctx_outs[0] & (1 << i)) vm.outs.w[i] = vm.saved_outs.w[i];
+                }
                 vm.pc   = vm.saved_pc;
+                vm.call_sp = vm.saved_call_sp;
 
                 // Reset the interrupt
                 vm.int_req = VM_INT_NONE;
                 
                 if(debug && CFG_DO_DEBUG){
-                    PLN("VM_OP_IRET");
+                    PLN(F("VM_OP_IRET"));
                 }
                 break;
                 
         }
 
         if(debug){
-            if(CFG_DO_DEBUG){
-                PR("int_mode "); PLN(vm.int_req);
-                
-                PR("regs");
-                PR(" "); PR(vm.regs.w[0], HEX);
-                PR(" "); PR(vm.regs.w[1], HEX);
-                PR(" "); PR(vm.regs.w[2], HEX);
-                PR(" "); PLN(vm.regs.w[3], HEX);
+            _vm_debug_dump(vm);
+            return n;
+        }
+    }
+}
+unsigned short vm_step(volatile vm_state_t& vm, bool debug){
+    // Program switch requested by vm_switch_program, done here on a tick boundary
+    if(vm.switch_req){
+        vm.imem     = vm.next_imem;
+        vm.imem_len = vm.next_imem_len;
+
+        for(byte i = 0;i < 4;i++) vm.ivec[i] = vm.next_ivec[i];
+        for(byte i = 0;i < VM_CONTEXTS;i++){
+            vm.ctx_entry[i] = vm.next_ctx_entry[i];
+            vm.ctx_outs[i]  = vm.next_ctx_outs[i];
+        }
+
+        vm.native = vm.next_native;
+
+      #if CFG_VM_COMPRESSED
+        _vm_z_flush();
+      #endif
+
+        _vm_reset_state(vm);
+
+      #if CFG_VM_ENGINE == 1
+        if(!vm.native) vm.pdec = _vm_predecode(vm);
+      #endif
+
+        vm.is_paused  = false;
+        vm.switch_req = false;
+    }
+
+    // Pause and debug check because the debug mode is intended
+    // to be used with the VM paused
+    if(vm.is_paused && !debug){
+        vm.is_paused_ack = true;
+        return 0;
+    }
     
-                PR("outs");
-                PR(" "); PR(vm.outs.w[0], HEX);
-                PR(" "); PR(vm.outs.w[1], HEX);
-                PR(" "); PLN(vm.outs.w[2], HEX);
-            }
+    vm.is_paused_ack = 0;
+    
+    // Start the next queued interrupt, unless context 0 halted
+    if(vm.int_req == VM_INT_NONE && vm.irq_tail != vm.irq_head && !(vm.ctx_halted & 1)){
+        byte           int_vector = vm.irq_queue[vm.irq_tail].vector;
+        unsigned short int_arg    = vm.irq_queue[vm.irq_tail].arg;
+
+        vm.irq_tail = (vm.irq_tail + 1) & (VM_IRQ_QUEUE_LEN - 1);
+
+        // Vector table built by the link pass
+        unsigned short int_entry = vm.ivec[int_vector];
+
+        bool enter_interrupt = int_entry != VM_IVEC_NONE;
+
+        if(enter_interrupt){
+            // Save regs and current program counter
+            _vm_copy_regs(vm.saved_regs, vm.regs);
+            _vm_copy_regs(vm.saved_outs, vm.outs);
+            vm.saved_pc   = vm.pc;
+            vm.saved_call_sp = vm.call_sp;
+
+            // Set %A
+            vm.regs.w[0] = int_arg;
+
+            // Jump to the interrupt
+            vm.pc = int_entry;
             
-            return;
+            vm.int_req = VM_INT_ONGOING;
+
+            // Stop the fades, the interrupt owns the outputs of context 0 now
+            for(byte i = 0;i < 3;i++){
+                if(vm.ctx_outs[0] & (1 << i)) vm.fade_left[i] = 0;
+            }
+            vm.fade_wait = false;
+
+            // Wake up from a wtn
+            vm.wait_left = 0;
+        } else {
+            if(debug && CFG_DO_DEBUG){
+                PLN(F("Requested interrupt but no vector found"));
+            }
+        }
+    }
+
+    // Fades run before the program, which sees their new values. Like a cmt of
+    // the contexts which own the oregs that faded
+    byte faded = _vm_fade_tick(vm);
+
+    if(faded){
+        byte mask = 0;
+
+        for(byte c = 0;c < VM_CONTEXTS;c++){
+            if(vm.ctx_outs[c] & faded) mask |= vm.ctx_outs[c];
         }
+
+        output_commit(vm.outs.w[0], vm.outs.w[1], vm.outs.w[2], mask);
     }
+
+    // From vm.ctx_first (context 0, unless the last tick was preempted) on, with a budget
+    // for all of them. In debug mode only context 0 runs
+    unsigned short n = 0;
+    byte first = debug ? 0 : vm.ctx_first;
+
+    vm.preempted = false;
+    vm.ctx_first = 0;
+
+    for(byte i = 0, c = first;i < VM_CONTEXTS;i++, c = (c + 1) % VM_CONTEXTS){
+        if(!(vm.ctx_active & (1 << c)) || (vm.ctx_halted & (1 << c))) continue;
+
+        if(c){
+            vm.ctx_cur = c;
+            _vm_ctx_swap(vm, c);
+        }
+
+        // A context with no budget left still counts down its wtn, and is preempted if it would run
+        bool preempted = vm.preempted;
+        n += _vm_run(vm, debug, n < CFG_VM_TICK_BUDGET ? CFG_VM_TICK_BUDGET - n : 0);
+
+        // The contexts which didn't run go first on the next tick
+        if(vm.preempted && !preempted) vm.ctx_first = (c + 1) % VM_CONTEXTS;
+
+        if(c){
+            _vm_ctx_swap(vm, c);
+            vm.ctx_cur = 0;
+        }
+
+        if(debug) break;
+
+        // hlt: the VM pauses (and resumes every context when it's unpaused) when all of them halted
+        if(vm.is_paused){
+            vm.ctx_halted |= 1 << c;
+
+            if(vm.ctx_halted == vm.ctx_active) vm.ctx_halted = 0;
+            else                               vm.is_paused  = false;
+        }
+    }
+
+    if(vm.preempted && vm.preempt_cnt != 0xffff) vm.preempt_cnt++;
+
+    return n;
 }
+
+
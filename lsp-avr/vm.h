@@ -3,13 +3,38 @@
 
 #define MAX_PROG_LEN 512
 
+// The program memory has an extra byte after MAX_PROG_LEN: the link pass
+// (see vm_reset) places a 'hlt' right after the program, so that a program
+// which runs off its last instruction halts instead of executing garbage
+#define VM_IMEM_SIZE (MAX_PROG_LEN + 1)
+
+// Compressed programs (CFG_VM_COMPRESSED in config.h, lspc -z): imem holds an image of up to
+// MAX_PROG_LEN bytes, with up to VM_Z_MAX_LEN bytes of bytecode compressed in blocks of
+// VM_Z_BLOCK_LEN bytes (see lspvm-asm/lspc_z.py). The interpreter fetches from a window of
+// two decompressed blocks, decoding a block when the pc moves to one that isn't in it.
+// Nothing else changes: the addresses in the program are the ones of the bytecode
+#define VM_Z_BLOCK_LEN 64
+#define VM_Z_MAX_LEN   1024
+
+// Depth of the call stack (call/ret)
+#define VM_CALL_DEPTH 4
+
+// Max number of contexts (see 'context' below), the main program included
+#define VM_CONTEXTS 4
+
+// Size of the interrupt requests queue (see vm_request_interrupt), power of 2.
+// It holds up to VM_IRQ_QUEUE_LEN - 1 requests
+#define VM_IRQ_QUEUE_LEN 8
+
 /*
     This is a "simple" 16 bit CISC virtual machine with a very basic
     instruction set which drives the LED outputs. The machine
     has 4 16-bit general purpose registers and 3 16-bit output registers.
     The VM is intended to run simple time based animations with the aid of
     two instructions which halt the machine until the next timer interrupt,
-    fired every millisecond ('cmt' and 'wt')
+    fired every millisecond ('cmt' and 'wt'). A program that doesn't reach one of these within its per-tick
+    instruction budget is preempted and resumes from the same point on the next tick, so a runaway loop
+    can't hang the firmware
 
     In the assembler source the registers are prefixed with a literal % (%A..%D),
     the output regs are prefixed with a literal @ (@R, @G and @B)
@@ -19,10 +44,10 @@
       PWM registers              8 bits    Not visible in the program. Writing on these directly sets the 3 channels' output brightness
     From now on normal registers are called 'regs', output registers 'oregs' and PWM registers 'pregs'
 
-    All registers hold a 16 bit unsigned value. When the oregs are latched to the PWM output (with the 'cmt' instruction) the MSB of the
-    oregs is multiplied by the MSB of the brightness (tracked outside of the VM), then the MSB of the result is written to the pregs.
-    This makes smooth animations possible due to the lower 8 bit of the oregs which behave like a fractional
-    part of the integer output value
+    All registers hold a 16 bit unsigned value. When the oregs are latched to the PWM output (with the 'cmt' instruction) they go through
+    the output stage (see output.h), which scales them by the brightness (tracked outside of the VM) and a gamma curve and writes the
+    result to the pregs. This makes smooth animations possible due to the lower 8 bit of the oregs which behave like a fractional
+    part of the integer output value, and which the output stage can turn into temporal dithering (CFG_OUT_DITHER)
 
     Some instructions take no data, some take one byte and some can take one
     or two bytes (see vm_opcode_e, 'data width' column). Two byte values are
@@ -60,11 +85,63 @@
     VM_OP_IVEC as opcode and the interrupt vector encoded in the .ro field. The instruction itself is a no-op, but
     when an interrupt is requested the VM saves the current program counter, regs and oregs to another location,
     sets %A to the 'a' passed to the command and jumps to the interrupt vector 'v'. An interrupt can do whatever it wants,
-    but other interrupt requests are ignored while an IRQ is being serviced. An interrupt handler has access to two more
+    and the requests which arrive while an IRQ is being serviced wait in a small queue (or are merged or dropped,
+    depending on the vector's policy, see CFG_VM_IRQ_POLICY_* in config.h). An interrupt handler has access to two more
     instructions, 'iret' and 'isetpc'. iret simply ends the interrupt, restoring saved regs/oregs and program counter.
     The handler can set the saved program counter with the 'isetpc' instruction, making it capable of setting where the VM
     will resume it's operation when exiting the interrupt
 
+    'fd @oreg, target, ticks' starts a linear fade of an oreg from its current value to target, which ends after
+    'ticks' timer ticks (the target has the same encoding as 'so': fdb sets the MSB). The fade is advanced by the
+    firmware at the beginning of every tick, in 16.8 fixed point, without executing any bytecode, and the outputs
+    are committed in every tick in which a fade ran. fd doesn't wait: a program can start fades on more oregs,
+    then wait for all of them to end with 'fwt' (encoded as fd with .ro = 3, no data). A new fd on an oreg replaces
+    its fade, a fade with 0 ticks sets the oreg right away. While an oreg fades, its value is overwritten every tick.
+    Entering an interrupt stops the fades of the oregs of context 0 (and ends its fwt)
+
+    'wtn ticks' is a multi-tick 'wt': the VM sleeps for 'ticks' timer ticks (wtn 1 is wt, wtn 0 does nothing) and
+    the firmware counts them down without executing any bytecode. A requested interrupt wakes the VM: the wait
+    ends, and the program continues after the wtn when the interrupt returns
+
+    'call uaddr' pushes the address of the next instruction on a small stack (VM_CALL_DEPTH entries, in vm_state_t)
+    and jumps to uaddr, 'ret' pops it and jumps back. A call with a full stack or a ret with an empty one halts the VM.
+    An interrupt handler starts on top of the program's stack, which is restored by iret (or emptied, if the handler
+    used isetpc to resume elsewhere)
+
+    A program can run up to VM_CONTEXTS independent contexts. Context 0 is the main program, which starts from 0 and
+    services the interrupts; 'context c @oreg...:' (c in [1, 3]) declares the entry point of context c and the oregs
+    it owns. It's encoded as VM_OP_IVEC with the pad bit set (VM_IVEC_CONTEXT), .ro = c and a data byte with the
+    mask of the oregs (bit i is oreg i); context 0 owns the oregs that no other context declared.
+    Every context has its own pc, regs, call stack, wtn and fwt, while imem and the oregs are shared. In every tick
+    the contexts run one after the other, starting from 0, each until its own cmt/wt/wtn/fwt. They share the tick's
+    instruction budget: when it runs out, the next tick starts from the context after the one that was preempted,
+    so a runaway context can't starve the others (or make the tick longer). A context's cmt latches (and its fwt waits for) only the oregs it owns, an interrupt saves and
+    restores only the oregs of context 0, iret and isetpc do nothing outside context 0, and a hlt halts only the context that executed it: the VM pauses when all of them halted.
+    The context instruction is a no-op, like ivec
+
+    The register operations (VM_OP_XOP) work between two registers: .ro is the destination, the data byte holds
+    the operation (high nibble, vm_xop_e) and the source (low nibble). In assembly the operation is picked by
+    the mnemonic and the types of the arguments:
+        mv  %dst, %src    add %dst, %src    sub %dst, %src
+        mv  @dst, %src    mv  %dst, @src    add @dst, %src
+    All of them are 16 bit and wrap around; add/sub with an oreg behave like 'mo' (adding 65535 is like subtracting 1)
+
+    With an addressable strip (CFG_STRIP_PIXELS, see strip.h) the register operations from VM_XOP_PFILL on work on
+    its whole frame buffer at once, so that an effect over all the pixels takes a few instructions per frame:
+        pfill %a, %b    pgrad %a, %b    prot %n    pshf %n    pscl %n    pfd %n    pget %i
+    Their operands are registers (a single one goes in .ro, with source 0), pixel indices are clamped to the last
+    pixel and ranges include both ends, in any order. The colour they take is the one of the oreg MSBs, pget sets
+    all three oregs like 'sob' (also the ones of the other contexts). cmt pushes the frame to the strip, if it changed.
+    Without a strip the link rejects them. The ones that go over the whole strip cost more of the tick budget, by
+    the length of the strip: half an instruction per pixel for pfill and pshf, one for pgrad and prot, 2 for pfd
+    and 3 for pscl (its multiplications)
+
+    Before running a program the VM links it (vm_reset). The link pass walks the bytecode once, builds the interrupt
+    vector and context tables (so that entering an interrupt doesn't require searching the vector) and verifies the program:
+    every instruction must have a known opcode and fit in the program length, every drjnz/j/ja/isetpc/call destination
+    must be the start of an instruction inside the program, and every context must be declared once, with its own oregs.
+    A program which doesn't pass the verification is not run
+
     Down below there are some handwritted test programs. I've also written a compiler (lspc), decompiler (lspd) and emulator (lspemu)
     inside the lspvm-asm folder and some assembly programs ready to be compiled in the progs folder
 */
@@ -74,23 +151,73 @@ typedef enum {         // Data width  ASM              Operation
     VM_OP_SETREG = 1,  // 8/16        sr reg, uval     Sets a register (A..D =)
     VM_OP_SETOUT = 2,  // 8/16        so oreg, uval    Sets an output reg (RGB =). The 8 bit instructions sets the MSB (LSB=0)
     VM_OP_MODOUT = 3,  // 8/16        mo oreg, val     Modify an output (RGB +=)
-    VM_OP_COMMIT = 4,  // 0           cmt              Send the output regs to the PWM outs and waits the next timer interrupt
+    VM_OP_COMMIT = 4,  // 0           cmt              Send the output regs to the PWM outs (and the frame to the strip) and waits the next timer interrupt
     VM_OP_WAIT   = 5,  // 0           wt               Stops the VM until the next timer interrupt (1ms)
     VM_OP_DRJNZ  = 6,  // 8/16        drjnz reg, addr  Decrement Reg, then Jump if Not Zero
     VM_OP_JMP    = 7,  // 8           j addr           Jump to relative address
     VM_OP_JMPABS = 8,  // 8/16        j uaddr          Jump to absolute address
     VM_OP_IVEC   = 9,  // 0           ivector v:       Entry point for the 'v' vector (the vector number 'v' [0, 3] is encoded in the .ro field of the instruction)
+                       // 8           context c @o..:  (pad bit set) Entry point of the context c [1, 3], data is the mask of its oregs
     VM_OP_ISETPC = 10, // 8/16        isetpc addr      Set the PC which is restored on iret
     VM_OP_IRET   = 11, // 0           iret             Exit from the interrupt
+    VM_OP_FADE   = 12, // 8/16 + 16   fd oreg, uval, ticks  Starts a fade of the output reg to uval in 'ticks' ticks (16 bit). 8 bit uval sets the MSB
+                       // 0           fwt              (.ro = 3) Waits until all the fades ended
+    VM_OP_WAITN  = 13, // 8/16        wtn uval         Stops the VM for uval timer interrupts
+    VM_OP_CALL   = 14, // 8/16        call uaddr       (.ro = 0) Pushes the return address and jumps to absolute address
+                       // 0           ret              (.ro = 1) Pops the return address and jumps to it
+    VM_OP_XOP    = 15, // 8           (see vm_xop_e)   Register operation, .ro is the destination, data is (op << 4) | source
 } vm_opcode_e;
 
+// .ro of VM_OP_CALL
+#define VM_CALL_CALL 0
+#define VM_CALL_RET  1
+
+typedef enum {          // ASM               Operation
+    VM_XOP_MOV    = 0,  // mv %dst, %src     dst = src
+    VM_XOP_ADD    = 1,  // add %dst, %src    dst += src
+    VM_XOP_SUB    = 2,  // sub %dst, %src    dst -= src
+    VM_XOP_SETOUT = 3,  // mv @dst, %src     Output reg dst = src
+    VM_XOP_GETOUT = 4,  // mv %dst, @src     dst = output reg src
+    VM_XOP_MODOUT = 5,  // add @dst, %src    Output reg dst += src
+
+    // Pixel operations (CFG_STRIP_PIXELS), the colour is the one of the oreg MSBs
+    VM_XOP_PFILL  = 8,  // pfill %a, %b      Pixels from a to b = colour
+    VM_XOP_PGRAD  = 9,  // pgrad %a, %b      Pixels between a and b = gradient from pixel a to pixel b
+    VM_XOP_PROT   = 10, // prot %n           Rotate the pixels by n (signed), towards the end when positive
+    VM_XOP_PSHIFT = 11, // pshf %n           Shift the pixels like prot, the ones left empty = colour
+    VM_XOP_PSCALE = 12, // pscl %n           Pixel channels *= n / 256, up to 255
+    VM_XOP_PFADE  = 13, // pfd %n            Pixel channels move n / 256 of the way to the colour (at least 1 if n != 0)
+    VM_XOP_PGET   = 14, // pget %i           Oregs = colour of pixel i (MSBs)
+} vm_xop_e;
+
+// .ro of VM_OP_FADE which encodes 'fwt'
+#define VM_FADE_WAIT 3
+
+// Pad bit of VM_OP_IVEC which makes it a 'context'
+#define VM_IVEC_CONTEXT 0B01000000
+
 
 typedef union {
     unsigned char  b[8];
     unsigned short w[4];
 } vm_regs_t;
 
+// State of a context while it isn't running (see vm_state_t.ctx)
 typedef struct {
+    vm_regs_t      regs;
+    unsigned short pc;
+    unsigned short call_stack[VM_CALL_DEPTH];
+    byte           call_sp;
+    unsigned short wait_left;
+    bool           fade_wait;
+} vm_context_t;
+
+struct vm_state_s;
+
+// A built-in program: bytecode translated to C++ by lspvm-asm/lspaot, run in place of the interpreter
+typedef unsigned short (*vm_native_t)(volatile struct vm_state_s& vm, bool debug, unsigned short budget);
+
+typedef struct vm_state_s {
     // Pause state. When the console code wants to stop the execution
     // it writes true to .is_paused, then waits for the VM to acknowledge
     // that by busy waiting for .is_paused_ack to become true
@@ -98,35 +225,140 @@ typedef struct {
 
     // Interrupt states
     #define VM_INT_NONE    0
-    #define VM_INT_PENDING 1
     #define VM_INT_ONGOING 2
 
-    // req state (VM_INT_*), vector and argument
-    byte int_req, int_vector;
-    unsigned short int_arg;
+    // req state (VM_INT_*)
+    byte int_req;
+
+    // Interrupt requests waiting to be serviced, a single producer (vm_request_interrupt, console)
+    // single consumer (vm_step, timer interrupt) ring. irq_head is written only by the producer,
+    // irq_tail only by the consumer
+    struct {
+        byte           vector;
+        unsigned short arg;
+    } irq_queue[VM_IRQ_QUEUE_LEN];
+
+    byte irq_head, irq_tail;
+
+    // Requests lost because the queue was full. Saturates at 0xffff
+    unsigned short irq_overflow;
+
+    // program memory (raw lspb bytecode, or a compressed image) and the length of the bytecode
+    byte*          imem;
+    unsigned short imem_len;
+
+    // Interrupt vector table (address of the 'ivec v' instruction), built by the link pass
+    #define VM_IVEC_NONE 0xffff
 
-    // program memory (raw lspb bytecode)
-    byte* imem;
+    unsigned short ivec[4];
+
+    // True if the program runs on the predecoded engine (see CFG_VM_ENGINE in config.h)
+    bool pdec;
+
+    // Built-in program (see vm_switch_builtin) which runs instead of imem, NULL if none
+    vm_native_t native;
+
+    // Program switch (see vm_switch_program): the next program, already linked
+    bool           switch_req;
+    byte*          next_imem;
+    unsigned short next_imem_len;
+    unsigned short next_ivec[4];
+    unsigned short next_ctx_entry[VM_CONTEXTS];
+    byte           next_ctx_outs[VM_CONTEXTS];
+    vm_native_t    next_native;
 
     // VCPU regs
     vm_regs_t      regs;  // A, B, C and D
     vm_regs_t      outs;  // R, G, B and Not Used
     unsigned short pc;
 
+    // Fades (VM_OP_FADE) of R, G and B: 16.8 fixed point value and per tick step,
+    // ticks left (0 if the oreg isn't fading) and target
+    long           fade_acc[3];
+    long           fade_step[3];
+    unsigned short fade_left[3];
+    unsigned short fade_target[3];
+
+    // Set by fwt, the VM doesn't run until all the fades ended
+    bool           fade_wait;
+
+    // Ticks left in a wtn
+    unsigned short wait_left;
+
+    // Number of ticks in which the program ran out of the instruction budget (CFG_VM_TICK_BUDGET,
+    // shared by the contexts) and was preempted. Saturates at 0xffff
+    unsigned short preempt_cnt;
+
+    // Set by the engines when the running context is preempted, for the tick
+    bool           preempted;
+
+    // Call stack (return addresses) and number of entries
+    unsigned short call_stack[VM_CALL_DEPTH];
+    byte           call_sp;
+
     // Saved state (set before jumping to an interrupt and restored before jumping back)
     vm_regs_t      saved_regs;
     vm_regs_t      saved_outs;
     unsigned short saved_pc;
+    byte           saved_call_sp;
+
+    // Contexts. The entry points (address of the 'context' instruction, VM_IVEC_NONE if the program
+    // doesn't declare it) and the oregs they declared are found by the link pass, ctx_entry[0] is always 0
+    unsigned short ctx_entry[VM_CONTEXTS];
+
+    // Oregs owned by each context (bit i: oreg i), context 0 owns the unused one too
+    byte ctx_outs[VM_CONTEXTS];
+
+    // Declared and halted contexts (bit c: context c)
+    byte ctx_active, ctx_halted;
+
+    // Context which runs first in the next tick, 0 unless the last one was preempted
+    byte ctx_first;
+
+    // Running context. The fields above (regs, pc, call stack, wtn and fwt) always hold the running
+    // context's state, the others wait in ctx[c - 1] and are swapped in while they run
+    byte         ctx_cur;
+    vm_context_t ctx[VM_CONTEXTS - 1];
 } vm_state_t;
 
 
-void vm_reset(volatile vm_state_t& vm, byte* imem);
+// Link result, see vm_reset
+#define VM_LINK_OK 0xffff
+
+// Resets the VM (paused) and links the program in imem[0, imem_len).
+// imem must be VM_IMEM_SIZE bytes long. Returns VM_LINK_OK or the address of the first
+// instruction that failed the verification (0 for a malformed compressed image); in that case
+// the VM halts as soon as it is unpaused
+unsigned short vm_reset(volatile vm_state_t& vm, byte* imem, unsigned short imem_len);
+
+// Links the program in imem[0, imem_len) and, if it passes the verification, makes the VM
+// switch to it at the beginning of the next tick: the state is reset and the VM runs the new
+// program from 0, unpaused. Blocks until the switch happened. Returns the link result
+// (see vm_reset); on failure the current program keeps running untouched
+unsigned short vm_switch_program(volatile vm_state_t& vm, byte* imem, unsigned short imem_len);
+
+// Makes the VM switch to the built-in program n (see CFG_VM_BUILTINS in config.h) at the beginning of the
+// next tick, like vm_switch_program. Returns false if there's no such program
+bool vm_switch_builtin(volatile vm_state_t& vm, byte n);
+
+// Number of built-in programs
+byte vm_builtin_count();
 
 void vm_set_pause(volatile vm_state_t& vm, bool pause);
 
-void vm_request_interrupt(volatile vm_state_t& vm, byte ivect, unsigned short arg);
+// Interrupt request policies, see CFG_VM_IRQ_POLICY_* in config.h
+#define VM_IRQ_QUEUE    0
+#define VM_IRQ_COALESCE 1
+#define VM_IRQ_DROP     2
+
+// Requests the interrupt ivect with %A = arg. It starts on the next tick if the VM isn't servicing
+// another one, otherwise it's handled according to the vector's policy. Returns false if the request
+// was dropped (by the policy, or because the queue is full)
+bool vm_request_interrupt(volatile vm_state_t& vm, byte ivect, unsigned short arg);
 
-void vm_step(volatile vm_state_t& vm, bool debug);
+// Runs the VM for a timer tick, returns the number of instructions executed (with the extra
+// cost of the pixel operations, as they're charged to the tick budget)
+unsigned short vm_step(volatile vm_state_t& vm, bool debug);
 
 
 /*
@@ -226,20 +458,16 @@ Interrupt test program 0 (vector 0: blink 2sec)
     
     sob @R, 0          0B00000010, 0,
     cmt                0B00000100,
-    srw %B, 500        0B10010001, 244, 1,
-    wt                 0B00000101,
-    drjnzb %B, -3      0B00010110, 253,
+    wtnw 500           0B10001101, 244, 1,
     
     sob @R, 255        0B00000010, 255,
     cmt                0B00000100,
-    srw %B, 500        0B10010001, 244, 1,
-    wt                 0B00000101,
-    drjnzb %B, -3      0B00010110, 253,
+    wtnw 500           0B10001101, 244, 1,
 
-    drjnzb %A, -20     0B00000110, 236,
+    drjnzb %A, -14     0B00000110, 242,
     iret               0B00001011
 
-    w9 w1w4 w2w0 w4 w145w244w1 w5 w22w253 w2w255 w4 w145w244w1 w5 w22w253 w6w236 w11
+    w9 w1w4 w2w0 w4 w141w244w1 w2w255 w4 w141w244w1 w6w242 w11
 
 Interrupt test program 1 (vector 0: change loop, arg = 1 for first loop, arg = 2 for second loop)
   base 0 (R 0->255->0 looping) at addr 0x0000
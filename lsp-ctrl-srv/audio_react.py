@@ -0,0 +1,303 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# Audio reactive mode: turns music into interrupt requests for the running program, so that
+# it can follow the beats and the sound level through its interrupt vectors.
+#
+# The source (a PulseAudio monitor, a WAV file played in real time, or raw S16LE mono at
+# 44.1 kHz from a pipe) is analyzed in hops of HOP_MS: the samples are decimated, windowed and
+# transformed (FFT_LEN points), then
+#   - a beat is a bass energy above REACT_BEAT_RATIO times its recent mean, at most one
+#     every REACT_BEAT_GAP_S: 'I<REACT_BEAT_VECTOR> <strength>'
+#   - the level is the whole band energy in dB, over the REACT_RANGE_DB below its recent
+#     peak (so the volume doesn't matter), 0-65535: 'I<REACT_LEVEL_VECTOR> <level>' at most
+#     REACT_LEVEL_HZ times a second, when it changes
+# The interrupts use at most REACT_LINK_SHARE of the audio link (a token bucket), the rest
+# is left to the other commands.
+# Every REACT_REPORT_S the latency of each stage is reported on stderr: analysis (from the
+# newest sample of the hop to the decision), queue (to the write to the link) and link (to
+# the end of the transmission), and the total.
+#
+# Run it alone to see what it would send, over a null link:
+#   ./audio_react.py <song.wav | - | monitor[:<pulse source>]>
+
+import cmath, math, sys, time, wave
+from array import array
+from threading import Thread
+
+import pulse_bridge as pulseb
+
+
+REACT_BEAT_VECTOR  = 3  # VM_IRQ_DROP in the firmware's default config: beats aren't queued
+REACT_LEVEL_VECTOR = 2  # VM_IRQ_COALESCE: a waiting level gets the newest one
+
+REACT_BEAT_RATIO = 1.6
+REACT_BEAT_GAP_S = 0.25
+REACT_RANGE_DB   = 40
+REACT_LEVEL_HZ   = 10
+REACT_LINK_SHARE = 0.5
+REACT_REPORT_S   = 10
+
+REACT_MONITOR = "@DEFAULT_MONITOR@"
+
+####
+####
+
+RATE    = 44100
+DECIM   = 4                    # analysis at 11025 Hz
+FFT_LEN = 256                  # 23 ms, 43 Hz bins
+HOP     = FFT_LEN // 2         # decimated samples, 11.6 ms
+HOP_MS  = HOP * DECIM * 1000 / RATE
+
+BASS_BINS = range(1, 4)        # 43-172 Hz
+ALL_BINS  = range(1, FFT_LEN // 2)
+
+_window   = [0.5 - 0.5 * math.cos(2 * math.pi * i / FFT_LEN) for i in range(FFT_LEN)]
+_twiddles = [cmath.exp(-2j * math.pi * k / FFT_LEN) for k in range(FFT_LEN // 2)]
+
+
+## Sources
+# read() returns the next HOP * DECIM samples (an array of signed shorts, mono) and the
+# time (time.monotonic()) of the newest one, or None at the end
+
+class WavSource:
+    # Played in real time, the samples are timed as if they were being heard
+
+    def __init__(self, path):
+        self._wav = wave.open(path, "rb")
+
+        if self._wav.getsampwidth() != 2 or self._wav.getframerate() != RATE:
+            raise ValueError(f"{path} isn't 16 bit at {RATE} Hz")
+
+        self._channels = self._wav.getnchannels()
+        self._pos      = 0
+        self._start    = None
+
+    def read(self):
+        data = array("h", self._wav.readframes(HOP * DECIM))
+        if len(data) < HOP * DECIM * self._channels:
+            return None
+
+        samples = data[::self._channels]
+
+        if self._start is None:
+            self._start = time.monotonic()
+
+        self._pos += HOP * DECIM
+        t = self._start + self._pos / RATE
+
+        left = t - time.monotonic()
+        if left > 0:
+            time.sleep(left)
+
+        return samples, t
+
+class PipeSource:
+    def __init__(self, fp):
+        self._fp = fp
+
+    def read(self):
+        data = self._fp.read(HOP * DECIM * 2)
+        if len(data) < HOP * DECIM * 2:
+            return None
+
+        return array("h", data), time.monotonic()
+
+class MonitorSource:
+    def __init__(self, device):
+        self._src = pulseb.PulseSource(device)
+
+    def read(self):
+        return array("h", self._src.read(HOP * DECIM * 2)), time.monotonic()
+
+def open_source(spec):
+    if spec == "monitor" or spec.startswith("monitor:"):
+        return MonitorSource(spec[8:] or REACT_MONITOR)
+    if spec == "-":
+        return PipeSource(sys.stdin.buffer)
+    if spec.endswith(".wav"):
+        return WavSource(spec)
+    return PipeSource(open(spec, "rb"))
+
+
+## Analysis
+def _fft(x):
+    # In place, radix 2
+    n = len(x)
+
+    j = 0
+    for i in range(1, n):
+        bit = n >> 1
+        while j & bit:
+            j ^= bit
+            bit >>= 1
+        j |= bit
+
+        if i < j:
+            x[i], x[j] = x[j], x[i]
+
+    size = 2
+    while size <= n:
+        half, step = size // 2, n // size
+
+        for start in range(0, n, size):
+            for k in range(half):
+                t = x[start + k + half] * _twiddles[k * step]
+                x[start + k + half] = x[start + k] - t
+                x[start + k] += t
+
+        size *= 2
+
+class Analyzer:
+    def __init__(self):
+        self._frame = [0.0] * FFT_LEN
+
+        self._bass_mean = 0.0
+        self._last_beat = -REACT_BEAT_GAP_S
+        self._peak_db   = -100.0
+
+    # Returns the beat strength (None if there isn't one) and the level of the hop at t
+    def hop(self, samples, t):
+        decim = [sum(samples[i:i + DECIM]) / (DECIM * 32768) for i in range(0, len(samples), DECIM)]
+        self._frame = self._frame[HOP:] + decim
+
+        spec = [complex(s * w) for s, w in zip(self._frame, _window)]
+        _fft(spec)
+        power = [abs(c) ** 2 for c in spec[:FFT_LEN // 2]]
+
+        bass = sum(power[k] for k in BASS_BINS)
+        beat = None
+
+        if bass > 1e-4 and bass > REACT_BEAT_RATIO * self._bass_mean and t - self._last_beat >= REACT_BEAT_GAP_S:
+            beat = min(65535, int(math.log2(bass / max(self._bass_mean, 1e-9)) * 8192))
+            self._last_beat = t
+
+        # About 0.5 s
+        self._bass_mean += (bass - self._bass_mean) * 0.02
+
+        db = 10 * math.log10(sum(power[k] for k in ALL_BINS) + 1e-12)
+        self._peak_db = max(db, self._peak_db - 3 * HOP_MS / 1000)  # decays 3 dB/s
+        level = (db - (self._peak_db - REACT_RANGE_DB)) / REACT_RANGE_DB
+
+        return beat, int(min(max(level, 0), 1) * 65535)
+
+
+## Latency
+class LatencyStats:
+    STAGES = ["analysis", "queue", "link", "total"]
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.ms   = {stage: [] for stage in self.STAGES}
+        self.sent = 0
+
+    # Timestamps of an update: newest sample, decision, write to the link, end of the transmission
+    def add(self, t_sample, t_analyzed, t_write, t_end):
+        for stage, dt in zip(self.STAGES, (t_analyzed - t_sample, t_write - t_analyzed, t_end - t_write, t_end - t_sample)):
+            self.ms[stage].append(dt * 1000)
+        self.sent += 1
+
+    def report(self, hops, limited):
+        parts = [f"{hops} hops, {self.sent} updates sent, {limited} rate limited"]
+
+        for stage in self.STAGES:
+            ms = sorted(self.ms[stage])
+            if ms:
+                parts.append(f"{stage} {sum(ms) / len(ms):.1f}/{ms[min(len(ms) - 1, int(len(ms) * 0.99))]:.1f} ms")
+
+        return ", ".join(parts) + " (mean/p99)"
+
+
+## Reactive mode
+class AudioReact(Thread):
+    # emit(irqs, on_sent): queues the interrupts [(vector, arg)], on_sent(t_write, t_end) is
+    # called once they're written to the link
+
+    def __init__(self, source, emit):
+        super().__init__(daemon=True)
+
+        self._source = source
+        self._emit   = emit
+        self.stats   = LatencyStats()
+
+        self._tokens    = 0.0
+        self._token_t   = time.monotonic()
+        self._bucket    = 24  # bytes, two updates
+        self._level     = None
+        self._level_t   = 0.0
+        self._hops      = 0
+        self._limited   = 0
+
+    def _take(self, nbytes, now):
+        self._tokens = min(self._bucket, self._tokens + (now - self._token_t) * pulseb.bytes_per_s() * REACT_LINK_SHARE)
+        self._token_t = now
+
+        if self._tokens < nbytes:
+            self._limited += 1
+            return False
+
+        self._tokens -= nbytes
+        return True
+
+    def run(self):
+        analyzer = Analyzer()
+        report_t = time.monotonic()
+
+        while True:
+            block = self._source.read()
+            if block is None:
+                break
+
+            samples, t_sample = block
+            beat, level = analyzer.hop(samples, t_sample)
+            self._hops += 1
+
+            t_analyzed = time.monotonic()
+            irqs = []
+
+            if beat is not None and self._take(len(f"I{REACT_BEAT_VECTOR} {beat}\n"), t_analyzed):
+                irqs.append((REACT_BEAT_VECTOR, beat))
+
+            if (t_analyzed - self._level_t >= 1 / REACT_LEVEL_HZ and (self._level is None or abs(level - self._level) >= 2048)
+                    and self._take(len(f"I{REACT_LEVEL_VECTOR} {level}\n"), t_analyzed)):
+                irqs.append((REACT_LEVEL_VECTOR, level))
+                self._level   = level
+                self._level_t = t_analyzed
+
+            if irqs:
+                self._emit(irqs, lambda t_write, t_end, ts=(t_sample, t_analyzed): self.stats.add(*ts, t_write, t_end))
+
+            if t_analyzed - report_t >= REACT_REPORT_S:
+                print("audio react: " + self.stats.report(self._hops, self._limited), file=sys.stderr)
+                self.stats.reset()
+                self._hops = self._limited = 0
+                report_t = t_analyzed
+
+        print("audio react: end of the source, " + self.stats.report(self._hops, self._limited), file=sys.stderr)
+
+
+def encode_irqs(irqs):
+    return b"".join(f"I{vector} {arg}\n".encode() for vector, arg in irqs)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        print("Usage: audio_react.py <song.wav | - | monitor[:<pulse source>]>", file=sys.stderr)
+        exit(1)
+
+    pulseb.init(pulseb.FileSink("/dev/null"))
+
+    def emit(irqs, on_sent):
+        ser_cmd = encode_irqs(irqs)
+        t_write = time.monotonic()
+        t_end   = pulseb.send_string(ser_cmd)
+
+        print(f"{t_write:.3f} {ser_cmd.decode().strip()}".replace("\n", " "))
+        on_sent(t_write, t_end)
+
+    react = AudioReact(open_source(sys.argv[1]), emit)
+    react.start()
+    react.join()
+    pulseb.flush()
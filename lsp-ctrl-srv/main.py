@@ -7,13 +7,41 @@ TCP_PORT = 1141
 # compiled programs folder path
 LSPVM_BIN_PATH = "../progs"
 
+# EEPROM program slots, must match CFG_EEPROM_SLOTS in the firmware (0 to disable).
+# The slot size follows from it: 248 bytes with 4 slots
+LSP_EEPROM_SLOTS     = 4
+LSP_EEPROM_SLOT_SIZE = 248
+
+# Which program is stored in which slot. A slot is recorded only when the LSP confirms the
+# 'e' on its USB serial (LSP_REPLY_TTY). A slot is loaded with the crc of the program, so the
+# LSP refuses one that holds something else (another server), but can't tell us over the audio
+# link: every LSP_SLOT_REFRESH loads from a slot the whole program is sent and stored again
+# (0 to never do it)
+LSP_SLOTS_PATH   = "lsp_slots.json"
+LSP_SLOT_REFRESH = 8
+
+# The LSP's USB serial, read for its replies (9600 baud with the audio link). Opening it
+# resets most Arduinos, once at startup. Without it (None, or a port which can't be opened)
+# the EEPROM slots aren't used, nothing would confirm them
+LSP_REPLY_TTY = "/dev/ttyUSB0"
+
+# How long after its transmission an 'e' must be confirmed: writing a full slot to the
+# EEPROM takes about 0.8 s
+LSP_STORE_TIMEOUT = 2
+
+# Programs are sent as patches against the previous one when it's shorter. The LSP rejects
+# a patch made against another program but can't tell us, so every LSP_PATCH_REFRESH
+# uploads the whole program is sent anyway (0 to always send it)
+LSP_PATCH_REFRESH = 8
+
 from socketserver import ThreadingTCPServer as TCPServer
 from http.server import BaseHTTPRequestHandler
 
 from threading import Thread, Lock, Event
-import os, time, json
+import os, sys, time, json, hashlib, queue, termios
 
 import pulse_bridge as pulseb
+import audio_react
 
 TCPServer.allow_reuse_address = True
 
@@ -31,7 +59,8 @@ class AttrDict(dict):
 
 class LSPCommandQueue:
     # This is a priority queue with a depth of one command per command type
-    # Newer commands overwrite older ones with the same type
+    # Newer commands overwrite older ones with the same type, except AUDIO_REACT: a pending
+    # one gets the new interrupts appended, so a beat isn't lost while an upload is written
 
     # Cmds
     #
@@ -51,9 +80,14 @@ class LSPCommandQueue:
     # Send a lsp binary to the board
     #   bytecode bytes    The raw lspb
     SEND_PROGRAM = 3
+
+    # Interrupt requests from the audio reactive mode (see audio_react.py)
+    #   irqs    list        (vector, arg) pairs
+    #   on_sent callable    called with the write time and the end of the transmission
+    AUDIO_REACT = 4
     
     # The lower the array index the higher the priority
-    cmd_priority = [SEND_PROGRAM, SEND_INTERRUPT, MODIFY_ON_STATE, MODIFY_BRIGHTNESS]
+    cmd_priority = [SEND_PROGRAM, SEND_INTERRUPT, AUDIO_REACT, MODIFY_ON_STATE, MODIFY_BRIGHTNESS]
     
     def __init__(self):
         self._lock      = Lock()
@@ -62,6 +96,15 @@ class LSPCommandQueue:
 
     def push(self, cmd):
         with self._lock:
+            pending = self._commands.get(cmd.type, None)
+
+            if cmd.type == self.AUDIO_REACT and pending:
+                def on_sent(t_write, t_end, first=pending.on_sent, then=cmd.on_sent):
+                    first(t_write, t_end)
+                    then(t_write, t_end)
+
+                cmd = AttrDict(cmd, irqs=pending.irqs + cmd.irqs, on_sent=on_sent)
+
             self._commands[cmd.type] = cmd
         self._added_evt.set()
     
@@ -76,54 +119,274 @@ class LSPCommandQueue:
             self._added_evt.wait()
             self._added_evt.clear()
 
+    # Every pending command in priority order, so that they're sent in one transmission
+    def pop_all(self):
+        while True:
+            with self._lock:
+                cmds = [self._commands[t] for t in self.cmd_priority if self._commands.get(t, None)]
+                if cmds:
+                    self._commands = {}
+                    return cmds
+            self._added_evt.wait()
+            self._added_evt.clear()
+
+
+def crc_ccitt(data, crc=0xffff):
+    # Same as avr-libc's _crc_ccitt_update, used by the firmware to check program frames
+    for byte in data:
+        byte ^= crc & 0xff
+        byte  = (byte ^ (byte << 4)) & 0xff
+        crc   = (((byte << 8) | (crc >> 8)) ^ (byte >> 4) ^ (byte << 3)) & 0xffff
+    return crc
+
+def program_crc(bytecode):
+    # The crc of a 'W' frame, which is also the one of the slot holding the program
+    return crc_ccitt(len(bytecode).to_bytes(2, "little") + bytecode)
+
+def program_frame(bytecode):
+    # 'W' command: length, bytecode and crc, 16 bit values in little endian
+    frame = len(bytecode).to_bytes(2, "little") + bytecode
+    return b"W" + frame + crc_ccitt(frame).to_bytes(2, "little")
+
+# Runs of bytes to patch to turn old into new: (offset, bytes). Runs closer than
+# PATCH_RUN_GAP bytes are merged, as a run header costs 3 bytes
+PATCH_RUN_GAP = 3
+
+def patch_runs(old, new):
+    runs = []
+
+    for i, byte in enumerate(new):
+        if i < len(old) and old[i] == byte:
+            continue
+
+        if runs and i - runs[-1][1] <= PATCH_RUN_GAP and i - runs[-1][0] < 255:
+            runs[-1][1] = i + 1
+        else:
+            runs.append([i, i + 1])
+
+    return [(start, new[start:end]) for start, end in runs]
+
+def patch_frame(old, new):
+    # 'X' command: new length, run count, runs (offset, count, bytes) and the crc of the
+    # whole new program (like the 'W' one), 16 bit values in little endian.
+    # None if there are too many runs
+    runs = patch_runs(old, new)
+    if len(runs) > 255:
+        return None
+
+    frame = b"X" + len(new).to_bytes(2, "little") + bytes([len(runs)])
+    for off, data in runs:
+        frame += off.to_bytes(2, "little") + bytes([len(data)]) + data
+
+    return frame + program_crc(new).to_bytes(2, "little")
+
+
+class LSPSlots:
+    # Tracks the programs stored in the EEPROM slots by their hash, evicting the
+    # least recently used slot when a new program needs one
+
+    def __init__(self, path, count, size):
+        self._path = path
+        self._size = size
+
+        try:
+            with open(path) as fp:
+                state = json.load(fp)
+            self._hashes = state["hashes"]
+            self._lru    = state["lru"]
+            if len(self._hashes) != count:
+                raise ValueError("slot count changed")
+        except:
+            self._hashes = [None] * count
+            self._lru    = list(range(count))  # least recently used first
+
+    def _save(self):
+        try:
+            with open(self._path, "w") as fp:
+                json.dump({"hashes": self._hashes, "lru": self._lru}, fp)
+        except OSError:
+            pass
+
+    def use(self, slot):
+        self._lru.remove(slot)
+        self._lru.append(slot)
+        self._save()
+
+    # The slot holding bytecode, None if it isn't stored
+    def find(self, bytecode):
+        h = hashlib.sha1(bytecode).hexdigest()
+        return self._hashes.index(h) if h in self._hashes else None
+
+    # The slot where bytecode should be stored, None if it doesn't fit in one
+    def pick(self, bytecode):
+        if not self._lru or len(bytecode) > self._size:
+            return None
+
+        return self._lru[0]
+
+    # Records what the LSP confirmed it stored in slot, None if the store failed
+    # (the slot may still hold the old program, or not)
+    def stored(self, slot, bytecode):
+        if bytecode is None:
+            self._hashes[slot] = None
+            self._save()
+        else:
+            self._hashes[slot] = hashlib.sha1(bytecode).hexdigest()
+            self.use(slot)
+
+
+class LSPReplies:
+    # Lines printed by the LSP on its USB serial, read in the background
+
+    def __init__(self, path):
+        fd = os.open(path, os.O_RDONLY | os.O_NOCTTY)
+
+        # raw 9600 8N1, without hanging up on close (which would reset the board again)
+        attr = termios.tcgetattr(fd)
+        attr[0] = attr[1] = attr[3] = 0
+        attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        attr[4] = attr[5] = termios.B9600
+        attr[6][termios.VMIN]  = 1
+        attr[6][termios.VTIME] = 0
+        termios.tcsetattr(fd, termios.TCSANOW, attr)
+
+        self._file  = os.fdopen(fd, "rb")
+        self._lines = queue.Queue()
+        Thread(target=self._read, daemon=True).start()
+
+    def _read(self):
+        for line in self._file:
+            self._lines.put(line.decode(errors="replace").strip())
+
+    # Drops what arrived so far
+    def clear(self):
+        try:
+            while True:
+                self._lines.get_nowait()
+        except queue.Empty:
+            pass
+
+    # The first line starting with one of prefixes, None if none arrives before deadline (time.monotonic())
+    def wait(self, prefixes, deadline):
+        while True:
+            try:
+                line = self._lines.get(timeout=max(0, deadline - time.monotonic()))
+            except queue.Empty:
+                return None
+
+            if line.startswith(prefixes):
+                return line
+
 
 lsp_state = AttrDict(
     is_on=False,
-    brightness=0
+    brightness=0,
+    react=False     # audio reactive mode, started with --react
 )
 
 lsp_cmd_queue = LSPCommandQueue()
 
+# The program in the LSP's load buffer (what a patch applies to), None if unknown
+lsp_image      = None
+lsp_uploads    = 0
+lsp_slot_loads = 0
+
+lsp_slots   = LSPSlots(LSP_SLOTS_PATH, LSP_EEPROM_SLOTS, LSP_EEPROM_SLOT_SIZE)
+lsp_replies = None  # LSPReplies, opened in main
+
+# The console bytes of a command, updates the state
+def lsp_encode_command(cmd):
+    global lsp_image, lsp_uploads, lsp_slot_loads
+
+    if cmd.type == LSPCommandQueue.MODIFY_ON_STATE:
+        if lsp_state.is_on == cmd.is_on:
+            return b""
+
+        lsp_state.is_on = cmd.is_on
+        return b"(" if cmd.is_on else b")"
+
+    if cmd.type == LSPCommandQueue.MODIFY_BRIGHTNESS:
+        if lsp_state.brightness == cmd.brightness:
+            return b""
+
+        lsp_state.brightness = cmd.brightness
+        # the newline ends the argument, so the command runs right away
+        return f"b{cmd.brightness}\n".encode()
+
+    if cmd.type == LSPCommandQueue.SEND_INTERRUPT:
+        return f"I{cmd.vector} {cmd.arg}\n".encode()
+
+    if cmd.type == LSPCommandQueue.AUDIO_REACT:
+        return audio_react.encode_irqs(cmd.irqs) if lsp_state.react else b""
+
+    if cmd.type == LSPCommandQueue.SEND_PROGRAM:
+        slot = lsp_slots.find(cmd.bytecode) if lsp_replies else None
+
+        if slot is not None:
+            lsp_slots.use(slot)
+            lsp_slot_loads += 1
+
+        if slot is not None and not (LSP_SLOT_REFRESH and lsp_slot_loads % LSP_SLOT_REFRESH == 0):
+            # already in the EEPROM, a few bytes instead of the whole program
+            ser_cmd = f"l{slot} {program_crc(cmd.bytecode)}\n".encode()
+        else:
+            # send prog bytecode to the load buffer while the old one keeps running,
+            # then switch to it (needs CFG_IMEM_DOUBLE_BUFFER in the firmware).
+            # The load buffer holds a copy of the running program, so usually
+            # only the changed bytes are needed
+            ser_cmd = program_frame(cmd.bytecode)
+
+            if lsp_image is not None and LSP_PATCH_REFRESH and lsp_uploads % LSP_PATCH_REFRESH:
+                patch = patch_frame(lsp_image, cmd.bytecode)
+                if patch is not None and len(patch) < len(ser_cmd):
+                    ser_cmd = patch
+
+            ser_cmd += b"P"
+            lsp_uploads += 1
+
+            # and keep it for the next time, in the same slot when refreshing it.
+            # The 'e' goes out on its own after this transmission (see lsp_store)
+            if lsp_replies:
+                cmd.store = slot if slot is not None else lsp_slots.pick(cmd.bytecode)
+
+        lsp_image = cmd.bytecode
+        return ser_cmd
+
+    return b""
+
 def lsp_state_handler():
-    global lsp_is_on, lsp_brightness
-    
     pulseb.init()
     while True:
-        cmd = lsp_cmd_queue.pop()
-        
-        if cmd.type == LSPCommandQueue.MODIFY_ON_STATE:
-            if lsp_state.is_on != cmd.is_on:
-                if cmd.is_on:
-                    pulseb.send_string(b"(")
-                else:
-                    pulseb.send_string(b")")
-
-                lsp_state.is_on = cmd.is_on
-        
-        elif cmd.type == LSPCommandQueue.MODIFY_BRIGHTNESS:
-            if lsp_state.brightness != cmd.brightness:
-                pulseb.send_string(f"b{cmd.brightness}".encode())
-                lsp_state.brightness = cmd.brightness
-        
-        elif cmd.type == LSPCommandQueue.SEND_INTERRUPT:
-            ser_cmd = f"I{cmd.vector} {cmd.arg}".encode()
-            pulseb.send_string(ser_cmd)
-        
-        elif cmd.type == LSPCommandQueue.SEND_PROGRAM:
-            ser_bytecode = "".join(f"w{b}" for b in cmd.bytecode).encode()
-            
-            # stop vm
-            pulseb.send_string(b"[")
-            time.sleep(0.1)
-            # rewind imem index
-            pulseb.send_string(b"r")
-            # send prog bytecode
-            pulseb.send_string(ser_bytecode)
-            # reset VM state, resume VM
-            pulseb.send_string(b"R]")
+        # whatever piled up while the previous transmission was queued goes in one,
+        # the audio link is written as a continuous stream
+        cmds    = lsp_cmd_queue.pop_all()
+        ser_cmd = b"".join(lsp_encode_command(cmd) for cmd in cmds)
+
+        if ser_cmd:
+            t_write = time.monotonic()
+            t_end   = pulseb.send_string(ser_cmd)
+
+            for cmd in cmds:
+                if "on_sent" in cmd:
+                    cmd.on_sent(t_write, t_end)
+
+        for cmd in cmds:
+            if cmd.get("store") is not None:
+                lsp_store(cmd.store, cmd.bytecode)
+
+# Stores the program just switched to in slot. The LSP doesn't read the link while it writes
+# the EEPROM, so the 'e' is sent alone and the commands queued meanwhile wait for its reply.
+# The slot is recorded only if the LSP confirms it: a failed upload leaves no running
+# program to store, and the LSP says so
+def lsp_store(slot, bytecode):
+    lsp_replies.clear()
+    t_end = pulseb.send_string(f"e{slot}\n".encode())
+
+    deadline = (t_end or time.monotonic()) + LSP_STORE_TIMEOUT
+    reply    = lsp_replies.wait(("Stored to slot", "No running program", "Bad slot"), deadline)
+
+    lsp_slots.stored(slot, bytecode if reply == f"Stored to slot {slot}" else None)
 
-lsp_state_thread = Thread(target=lsp_state_handler)
-lsp_state_thread.start()
 
 
 class LSPRequestHandler(BaseHTTPRequestHandler):
@@ -181,6 +444,12 @@ class LSPRequestHandler(BaseHTTPRequestHandler):
             ))
             return 200
         
+        if self.path in ("/react-on", "/react-off"):
+            if lsp_react is None:
+                return 409  # not started with --react
+            lsp_state.react = self.path == "/react-on"
+            return 200
+
         if self.path == "/brightness":
             try:
                 b = int(self.query)
@@ -230,5 +499,33 @@ class LSPRequestHandler(BaseHTTPRequestHandler):
 
 
 
-httpd = TCPServer(("", TCP_PORT), LSPRequestHandler)
-httpd.serve_forever()
+def lsp_react_emit(irqs, on_sent):
+    lsp_cmd_queue.push(AttrDict(
+        type=LSPCommandQueue.AUDIO_REACT,
+        irqs=irqs,
+        on_sent=on_sent
+    ))
+
+lsp_react = None
+
+if __name__ == "__main__":
+    # main.py [--react <song.wav | - | monitor[:<pulse source>]>]
+    if len(sys.argv) == 3 and sys.argv[1] == "--react":
+        lsp_react = audio_react.AudioReact(audio_react.open_source(sys.argv[2]), lsp_react_emit)
+        lsp_react.start()
+        lsp_state.react = True
+    elif len(sys.argv) != 1:
+        print("Usage: main.py [--react <song.wav | - | monitor[:<pulse source>]>]", file=sys.stderr)
+        exit(1)
+
+    if LSP_EEPROM_SLOTS and LSP_REPLY_TTY:
+        try:
+            lsp_replies = LSPReplies(LSP_REPLY_TTY)
+        except OSError as e:
+            print(f"No replies from {LSP_REPLY_TTY} ({e.strerror}), EEPROM slots not used", file=sys.stderr)
+
+    lsp_state_thread = Thread(target=lsp_state_handler)
+    lsp_state_thread.start()
+
+    httpd = TCPServer(("", TCP_PORT), LSPRequestHandler)
+    httpd.serve_forever()
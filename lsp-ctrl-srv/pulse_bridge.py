@@ -1,25 +1,37 @@
 # Bridge between pulseaudio and python
 
-import ctypes
+import ctypes, time
 from math import sin, tau
 
 
-__all__ = ["init", "send_string"]
+__all__ = ["init", "send_string", "flush", "modulate", "bytes_per_s", "FileSink", "PulseSource"]
 
-## Pulse
-pa_lib = ctypes.cdll.LoadLibrary('libpulse-simple.so.0')
+## Pulse, loaded by init() so that the modulator works without it
+_pa_simple_new   = None
+_pa_simple_write = None
+_pa_simple_drain = None
+_pa_simple_read  = None
 
-_pa_simple_new = pa_lib.pa_simple_new
-_pa_simple_new.restype = ctypes.c_voidp
+def _load_pulse():
+    global _pa_simple_new, _pa_simple_write, _pa_simple_drain, _pa_simple_read
 
-_pa_simple_write = pa_lib.pa_simple_write
-_pa_simple_write.argtypes = [ctypes.c_voidp, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t, ctypes.POINTER(ctypes.c_int)]
+    pa_lib = ctypes.cdll.LoadLibrary('libpulse-simple.so.0')
 
-_pa_simple_drain = pa_lib.pa_simple_drain
-_pa_simple_drain.argtypes = [ctypes.c_voidp, ctypes.POINTER(ctypes.c_int)]
+    _pa_simple_new = pa_lib.pa_simple_new
+    _pa_simple_new.restype = ctypes.c_voidp
+
+    _pa_simple_write = pa_lib.pa_simple_write
+    _pa_simple_write.argtypes = [ctypes.c_voidp, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t, ctypes.POINTER(ctypes.c_int)]
+
+    _pa_simple_drain = pa_lib.pa_simple_drain
+    _pa_simple_drain.argtypes = [ctypes.c_voidp, ctypes.POINTER(ctypes.c_int)]
+
+    _pa_simple_read = pa_lib.pa_simple_read
+    _pa_simple_read.argtypes = [ctypes.c_voidp, ctypes.c_char_p, ctypes.c_size_t, ctypes.POINTER(ctypes.c_int)]
 
 
 PA_STREAM_PLAYBACK = 1
+PA_STREAM_RECORD = 2
 PA_SAMPLE_S16LE = 3
 PA_SAMPLE_FLOAT32LE = 5
 
@@ -38,81 +50,215 @@ struct_pa_sample_spec._fields_ = [
 ]
 
 
+class struct_pa_buffer_attr(ctypes.Structure):
+    _fields_ = [
+        ('maxlength', ctypes.c_uint32),
+        ('tlength', ctypes.c_uint32),
+        ('prebuf', ctypes.c_uint32),
+        ('minreq', ctypes.c_uint32),
+        ('fragsize', ctypes.c_uint32),
+    ]
+
+PA_DEFAULT = 0xffffffff
+
+
 ## Wave generator
+# Pulse distance modulation, see lsp-avr/audio_rx.h (the values must match it): bursts
+# of carrier, with the data in the distance between them (in samples)
 sample_rate = 44100
 
-baudrate  = 44100 // 16  #
-sig_waves = 4    # Waves/bit
+sym_min   = 16  # Distance of symbol 0, symbol n is sym_min + n * sym_step (2 bits)
+sym_step  = 3
+sync_dist = 30  # Before every byte but the first
+lead_dist = 100 # Lone burst before a transmission, which holds the firmware's strip push (AUDIO_RX_LEAD)
 
-phase_off =  (tau / 360) * 15  # Wave phase offset
+carrier_freq = sample_rate / 4
+burst_len    = 8   # samples, 2 carrier cycles
+amplitude    = 32767
 
 ####
 ####
 
-samples_per_bit = int(sample_rate / baudrate)
-sig_freq = sample_rate / (samples_per_bit / sig_waves)  # carrier freq
-
-def genwave(freq):
-    nsamples = samples_per_bit
+def genwave(freq, nsamples):
     out = bytearray(nsamples * 2)
 
     for sample_i in range(nsamples):
-        global sample_rate
         angle = sample_i / sample_rate * freq * tau
-        s = int(sin(angle + phase_off) * 32768)
+        s = int(sin(angle) * amplitude)
 
         out[sample_i *2 +0] = s & 0x00ff
         out[sample_i *2 +1] = (s & 0xff00) >> 8
 
     return bytes(out)
 
-zero_wave = genwave(sig_freq)  # logical zero
-one_wave  = b"\x00\x00" * samples_per_bit  # logical one
+burst_wave = genwave(carrier_freq, burst_len)
 
-def gen_serial_byte(byte):
-    out = zero_wave  # start
+def silence(nsamples):
+    return b"\x00\x00" * nsamples
+
+# Pulse distances of a byte: 4 symbols, least significant bits first
+def byte_dists(byte):
+    return [sym_min + ((byte >> (i * 2)) & 3) * sym_step for i in range(4)]
+
+def _dists_wave(dists):
+    return b"".join(silence(dist - burst_len) + burst_wave for dist in dists)
+
+# Waveforms of every byte, after the burst which ends the previous one: the first
+# byte of a transmission, and the others (with the sync before them)
+first_byte_waves = [_dists_wave(byte_dists(byte)) for byte in range(256)]
+next_byte_waves  = [_dists_wave([sync_dist] + byte_dists(byte)) for byte in range(256)]
 
-    for i in range(8):
-        out = out + (one_wave if ((byte >> i) & 1) else zero_wave)
+# Ends the last burst, and keeps the next transmission's first burst a sync away
+end_wave = silence(sync_dist)
 
-    out += one_wave + one_wave  # two stop bits to improve stability
-    return out
+# Starts a transmission: the lead burst, then the one the first byte is measured from
+lead_wave = burst_wave + _dists_wave([lead_dist])
 
+# The samples (S16LE) of bstring: the lead, then for every distance the silence after
+# the previous burst and the next burst, then a sync of silence
+def modulate(bstring):
+    if not bstring:
+        return b""
 
-pa_stream = None
+    out = [lead_wave, first_byte_waves[bstring[0]]]
+    out += [next_byte_waves[byte] for byte in bstring[1:]]
+    out.append(end_wave)
 
-def init():
-    # Connection to pulseaudio server
-    global pa_stream, sample_rate
+    return b"".join(out)
+
+# Mean link throughput, with equally likely symbols
+def bytes_per_s():
+    return sample_rate / (sync_dist + 4 * sym_min + 6 * sym_step)
+
+
+## Sinks
+# The transmissions are written back to back, without waiting for them to be played:
+# write() blocks only while the sink's buffer is full, so the next transmission is
+# queued while the previous one plays. Both sinks keep a play clock, the time
+# (time.monotonic()) when what has been written so far will have been played
+
+# Samples buffered in the sink, the latency bound of a transmission written to an idle link
+buffer_ms = 50
+
+class _Sink:
+    def __init__(self):
+        self.play_end = 0
 
-    sspec = struct_pa_sample_spec()
-    sspec.rate = sample_rate
-    sspec.channels = 1
-    sspec.format = PA_SAMPLE_S16LE
+    def _advance(self, nbytes):
+        self.play_end = max(time.monotonic(), self.play_end) + nbytes / 2 / sample_rate
+
+class PulseSink(_Sink):
+    def __init__(self):
+        super().__init__()
+        _load_pulse()
 
-    pa_stream = _pa_simple_new(
-        None,                              # default server
-        b"SerialOverAudio\x00",            # stream name
-        PA_STREAM_PLAYBACK,                # record/playback
-        None,                              # default device
-        b"Serial over audio channel\x00",  # stream description
-        ctypes.byref(sspec),               # sample spec
-        None,                              # default channel map
-        None,                              # default buffering attributes
-        None                               # ignore returned errors
-    )
+        sspec = struct_pa_sample_spec()
+        sspec.rate = sample_rate
+        sspec.channels = 1
+        sspec.format = PA_SAMPLE_S16LE
 
+        # A short buffer, which never waits to be refilled: an underrun plays
+        # silence, the link's idle state
+        battr = struct_pa_buffer_attr()
+        battr.maxlength = PA_DEFAULT
+        battr.tlength   = sample_rate * 2 * buffer_ms // 1000
+        battr.prebuf    = 0
+        battr.minreq    = PA_DEFAULT
+        battr.fragsize  = PA_DEFAULT
 
+        self._stream = _pa_simple_new(
+            None,                              # default server
+            b"SerialOverAudio\x00",            # stream name
+            PA_STREAM_PLAYBACK,                # record/playback
+            None,                              # default device
+            b"Serial over audio channel\x00",  # stream description
+            ctypes.byref(sspec),               # sample spec
+            None,                              # default channel map
+            ctypes.byref(battr),               # buffering attributes
+            None                               # ignore returned errors
+        )
+
+    def write(self, buf):
+        self._advance(len(buf))
+        _pa_simple_write(self._stream, buf, len(buf), None)
+
+    def drain(self):
+        _pa_simple_drain(self._stream, None)
+
+class FileSink(_Sink):
+    # Raw S16LE samples to a file (/dev/null for a null sink), played in real time like
+    # a sound card with a buffer of buffer_ms would, a stand-in for PulseAudio in tests
+
+    def __init__(self, path):
+        super().__init__()
+        self._file = open(path, "wb")
+
+    def write(self, buf):
+        self._advance(len(buf))
+        self._file.write(buf)
+
+        ahead = self.play_end - time.monotonic() - buffer_ms / 1000
+        if ahead > 0:
+            time.sleep(ahead)
+
+    def drain(self):
+        self._file.flush()
+
+        left = self.play_end - time.monotonic()
+        if left > 0:
+            time.sleep(left)
+
+
+## Sources
+class PulseSource:
+    # Records S16LE mono at sample_rate, from a monitor source for the audio reactive mode
+
+    def __init__(self, device):
+        _load_pulse()
+
+        sspec = struct_pa_sample_spec()
+        sspec.rate = sample_rate
+        sspec.channels = 1
+        sspec.format = PA_SAMPLE_S16LE
+
+        self._stream = _pa_simple_new(
+            None,                              # default server
+            b"AudioReact\x00",                 # stream name
+            PA_STREAM_RECORD,                  # record/playback
+            device.encode() + b"\x00",         # source
+            b"Audio reactive mode input\x00",  # stream description
+            ctypes.byref(sspec),               # sample spec
+            None,                              # default channel map
+            None,                              # default buffering attributes
+            None                               # ignore returned errors
+        )
+
+        if not self._stream:
+            raise OSError(f"can't record from {device}")
+
+    def read(self, nbytes):
+        buf = ctypes.create_string_buffer(nbytes)
+        _pa_simple_read(self._stream, buf, nbytes, None)
+        return buf.raw
+
+
+sink = None
+
+def init(to=None):
+    # Connection to pulseaudio server, or to another sink
+    global sink
+
+    sink = to if to is not None else PulseSink()
+
+
+# Queues bstring after the previous transmissions, returns when it will have been
+# played (time.monotonic())
 def send_string(bstring):
-    if not pa_stream: return
-    
-    buf = b""
-    
-    for byte in bstring:
-        buf += gen_serial_byte(byte)
-
-    # write data
-    _pa_simple_write(pa_stream, buf, len(buf), None)
-    # flush data
-    _pa_simple_drain(pa_stream, None)
+    if not sink: return None
+
+    sink.write(modulate(bstring))
+    return sink.play_end
 
+# Waits until everything has been played
+def flush():
+    if sink: sink.drain()
@@ -0,0 +1,213 @@
+/*
+    audiorx: runs the firmware's audio link receiver (lsp-avr/audio_rx.cpp) on a
+    recording or a generated WAV file (16 bit PCM, the first channel), to measure the
+    link without the board (see modem-test).
+
+    The line out goes through a model of the ASK filter and of the pin: the rectified
+    signal charges an envelope with separate attack and release time constants, and
+    the pin reads low while the envelope is above the threshold (with hysteresis).
+    The falling edges are timestamped like micros() does on the board (see board_micros,
+    with an optional random interrupt latency) and fed to audio_rx_edge.
+    With -p the firmware also pushes a strip frame (strip.h) in every 1 ms tick in
+    which audio_rx_busy allows it, and the edges during a push are timestamped at its end.
+    The received bytes are written to stdout, a summary to stderr
+*/
+
+#include <Arduino.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "audio_rx.h"
+
+
+static void usage(){
+    fprintf(stderr,
+        "Usage: audiorx [OPTIONS] <in.wav>\n"
+        "Decodes the audio link like the firmware, writes the received bytes to stdout\n"
+        "  -a <us>             filter attack time constant (default 5)\n"
+        "  -r <us>             filter release time constant (default 60)\n"
+        "  -t <0-1>            pin threshold, of the full scale (default 0.25, hysteresis 0.1 below it)\n"
+        "  -l <us>             max interrupt latency, random (default 0)\n"
+        "  -p <us>             strip push length, with the interrupts off (default 0, no strip)\n"
+        "  -s <seed>           random seed (default 1)\n"
+        "  -j                  print the summary as a JSON object on stderr\n"
+    );
+    exit(1);
+}
+
+
+// Interpolated samples per sample, for the filter model
+#define OVERSAMPLE 8
+
+
+// micros() on the board at t_us real microseconds: Timer0 counts every cycle (16 per us) for
+// the PWM, and the core multiplies its count by 4, as if it were prescaled by 64. Wraps like it
+static unsigned long board_micros(double t_us){
+    return (unsigned long)fmod(floor(t_us * 16) * 4, 4294967296.0);
+}
+
+
+static unsigned long le(const unsigned char* p, int n){
+    unsigned long v = 0;
+
+    while(n--) v = (v << 8) | p[n];
+
+    return v;
+}
+
+// Reads the first channel of a 16 bit PCM WAV file, scaled to -1..1
+static std::vector<float> load_wav(const char* path, unsigned long* rate){
+    std::vector<float> samples;
+    unsigned char      hdr[8], fmt[16];
+    unsigned int       channels = 0, bits = 0;
+
+    FILE* wav = fopen(path, "rb");
+    if(!wav){
+        fprintf(stderr, "Error: can't open %s\n", path);
+        exit(1);
+    }
+
+    if(fread(hdr, 1, 8, wav) != 8 || memcmp(hdr, "RIFF", 4) || fread(hdr, 1, 4, wav) != 4 || memcmp(hdr, "WAVE", 4)){
+        fprintf(stderr, "Error: %s isn't a WAV file\n", path);
+        exit(1);
+    }
+
+    while(fread(hdr, 1, 8, wav) == 8){
+        unsigned long len = le(hdr + 4, 4);
+
+        if(!memcmp(hdr, "fmt ", 4) && len >= 16){
+            if(fread(fmt, 1, 16, wav) != 16) break;
+            fseek(wav, len - 16 + (len & 1), SEEK_CUR);
+
+            channels = le(fmt + 2, 2);
+            *rate    = le(fmt + 4, 4);
+            bits     = le(fmt + 14, 2);
+
+            if(le(fmt, 2) != 1 || bits != 16 || !channels){
+                fprintf(stderr, "Error: %s isn't 16 bit PCM\n", path);
+                exit(1);
+            }
+        } else if(!memcmp(hdr, "data", 4) && channels){
+            unsigned char frame[2 * 16];
+
+            if(channels > 16){
+                fprintf(stderr, "Error: %s has too many channels\n", path);
+                exit(1);
+            }
+
+            for(unsigned long i = 0;i < len / (2 * channels);i++){
+                if(fread(frame, 2 * channels, 1, wav) != 1) break;
+                samples.push_back((short)le(frame, 2) / 32768.0f);
+            }
+            break;
+        } else {
+            fseek(wav, len + (len & 1), SEEK_CUR);
+        }
+    }
+    fclose(wav);
+
+    if(!channels){
+        fprintf(stderr, "Error: %s has no format chunk\n", path);
+        exit(1);
+    }
+
+    return samples;
+}
+
+
+int main(int argc, char** argv){
+    double        attack_us = 5, release_us = 60, thr = 0.25, latency_us = 0, push_us = 0;
+    unsigned int  seed = 1;
+    bool          json = false;
+    int           opt;
+
+    while((opt = getopt(argc, argv, "a:r:t:l:p:s:j")) != -1){
+        switch(opt){
+            case 'a': attack_us  = atof(optarg); break;
+            case 'r': release_us = atof(optarg); break;
+            case 't': thr        = atof(optarg); break;
+            case 'l': latency_us = atof(optarg); break;
+            case 'p': push_us    = atof(optarg); break;
+            case 's': seed       = strtoul(optarg, NULL, 0); break;
+            case 'j': json       = true; break;
+            default:  usage();
+        }
+    }
+
+    if(optind != argc - 1 || attack_us <= 0 || release_us <= 0 || thr <= 0.1 || thr >= 1 || latency_us < 0 || push_us < 0 || push_us >= 1000) usage();
+
+    unsigned long      rate;
+    std::vector<float> samples = load_wav(argv[optind], &rate);
+
+    srand(seed);
+    audio_rx_init();
+
+    double step_us = 1e6 / rate / OVERSAMPLE;
+    double k_att   = 1 - exp(-step_us / attack_us);
+    double k_rel   = 1 - exp(-step_us / release_us);
+    double env     = 0;
+    bool   low     = false;
+
+    unsigned long edges = 0, bytes = 0;
+
+    // Strip pushes: the next tick, the end of the last push
+    double        tick_us = 1e6, push_end_us = 0;
+    unsigned long pushes = 0;
+
+    for(size_t i = 0;i < samples.size();i++){
+        float next = i + 1 < samples.size() ? samples[i + 1] : 0;
+
+        for(int j = 0;j < OVERSAMPLE;j++){
+            double x = fabs(samples[i] + (next - samples[i]) * j / OVERSAMPLE);
+
+            env += (x - env) * (x > env ? k_att : k_rel);
+
+            if(!low && env > thr){
+                // The board has been running for a while
+                double t_us = 1e6 + (i * OVERSAMPLE + j) * step_us;
+
+                if(latency_us > 0) t_us += latency_us * rand() / RAND_MAX;
+
+                // The ticks before the interrupt runs, then it waits for the end of their push
+                for(;push_us > 0 && tick_us <= t_us;tick_us += 1000){
+                    if(audio_rx_busy(board_micros(tick_us))) continue;
+
+                    push_end_us = tick_us + push_us;
+                    pushes++;
+                }
+
+                if(t_us < push_end_us) t_us = push_end_us;
+
+                low = true;
+                edges++;
+                audio_rx_edge(board_micros(t_us));
+
+                // As the console would, before the buffer fills up
+                int c;
+                while((c = audio_rx_read()) >= 0){
+                    putchar(c);
+                    bytes++;
+                }
+            } else if(low && env < thr - 0.1){
+                low = false;
+            }
+        }
+    }
+
+    double secs = (double)samples.size() / rate;
+
+    if(json){
+        fprintf(stderr, "{\"samples\": %lu, \"s\": %.3f, \"edges\": %lu, \"bytes\": %lu, \"errors\": %u, \"pushes\": %lu, \"bytes_per_s\": %.1f}\n",
+            (unsigned long)samples.size(), secs, edges, bytes, audio_rx_errors(), pushes, secs > 0 ? bytes / secs : 0.0);
+    } else {
+        fprintf(stderr, "%lu samples (%.3f s), %lu edges, %lu bytes, %u errors, %lu strip pushes, %.1f bytes/s\n",
+            (unsigned long)samples.size(), secs, edges, bytes, audio_rx_errors(), pushes, secs > 0 ? bytes / secs : 0.0);
+    }
+
+    return 0;
+}
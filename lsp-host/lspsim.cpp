@@ -0,0 +1,525 @@
+/*
+    lspsim: runs a compiled lsp program (.lspb) on the firmware's own vm.cpp,
+    built for the host against the Arduino shim in shim/.
+    Every tick is a simulated Timer1 interrupt (1 ms on the board), but the
+    emulator runs them back to back, as fast as the host allows.
+
+    The trace has one line per tick:
+        <tick> <pwm R> <pwm G> <pwm B> <oreg R> <oreg G> <oreg B>
+    where the pwm values are the ones written to OCR0A, OCR0B and OCR2A.
+    With a strip (CFG_STRIP_PIXELS) and -p, the lines of the ticks which push a
+    frame end with its pixels, rrggbb in hex from the first one
+*/
+
+#include <Arduino.h>
+#include <TimerOne.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+#include "output.h"
+#include "strip.h"
+#include "envelope.h"
+#include "audio_rx.h"
+#include "config.h"
+
+
+static void usage(){
+    fprintf(stderr,
+        "Usage: lspsim [OPTIONS] <pgm.lspb>\n"
+        "       lspsim [OPTIONS] -B <n>\n"
+        "Runs a lsp program on the firmware VM, faster than real time\n"
+        "  -B <n>              run the built-in program n instead (see CFG_VM_BUILTINS, lspsim-aot)\n"
+        "  -n <ticks>          number of 1 ms ticks to run (default 10000)\n"
+        "  -b <0-255>          output brightness (default 255)\n"
+        "  -r <tick>:<0-255>   ramp the brightness at tick, like the 'b' command (repeatable)\n"
+        "  -f <ms>:<curve>     brightness ramp duration and curve, like the 'f' command\n"
+        "  -i <tick>:<v>:<a>   request interrupt v with argument a at tick (repeatable)\n"
+        "  -s <tick>:<pgm>     switch to another program at tick, like the 'P' command (repeatable)\n"
+        "  -o <file>           write the trace to file instead of stdout\n"
+        "  -p                  trace the strip frames (see CFG_STRIP_PIXELS, the host builds have 16 pixels)\n"
+        "  -c                  only trace ticks where the pwm outputs change (or a frame is pushed)\n"
+        "  -q                  don't write the trace, print the summary only\n"
+        "  -j                  print the summary as a JSON object on stdout (implies -q)\n"
+    );
+    exit(1);
+}
+
+
+// Firmware globals, see lsp-avr.ino
+byte lsp_imem[2][VM_IMEM_SIZE];
+
+vm_state_t lsp_vm;
+
+volatile envelope_t brightness;
+
+
+struct irq_req_t {
+    unsigned long  tick;
+    byte           vector;
+    unsigned short arg;
+};
+
+static std::vector<irq_req_t> irq_reqs;
+
+
+struct ramp_req_t {
+    unsigned long tick;
+    byte          bright;
+};
+
+static std::vector<ramp_req_t> ramp_reqs;
+
+
+struct switch_req_t {
+    unsigned long tick;
+    const char*   path;     // NULL for a built-in program
+    unsigned int  builtin;
+};
+
+static std::vector<switch_req_t> switch_reqs;
+
+
+// Trace state
+static FILE*         out;
+static bool          only_changes;
+static bool          trace_strip;
+static bool          quiet;
+static int           last_pwm = -1;
+static unsigned long tick;
+
+// Per tick value -> number of ticks
+typedef std::map<unsigned long, unsigned long> histogram_t;
+
+// Instructions executed per tick
+static unsigned long long inst_sum;
+static unsigned short     inst_max;
+static histogram_t        inst_hist;
+
+
+#ifdef VM_PROFILE
+// Estimated AVR cycles of the classic engine per instruction, fetch and dispatch included, by opcode
+// and width (byte, word). Counted by hand on the avr-gcc -O2 code paths, so they are approximate
+static const unsigned short prof_inst_cycles[16][2] = {
+    { 40,  40},  // hlt
+    { 42,  50},  // sr
+    { 42,  50},  // so
+    { 50,  60},  // mo
+    {220, 220},  // cmt (output_commit of 3 channels)
+    { 35,  35},  // wt
+    { 55,  65},  // drjnz
+    { 45,  45},  // j
+    { 45,  50},  // ja
+    { 32,  32},  // ivec, context
+    { 48,  55},  // isetpc
+    {140, 140},  // iret
+    {760, 770},  // fd (32 bit division), fwt
+    { 45,  52},  // wtn
+    { 60,  65},  // call, ret
+    { 60,  60}   // xop (the pixel operations add prof_pixel_cycles)
+};
+
+// Per pixel of the strip, of the pixel operations (VM_XOP_PFILL on) which loop over it
+static const unsigned short prof_pixel_cycles[7] = {
+     15,  // pfill
+     35,  // pgrad
+     40,  // prot (three reversals)
+     15,  // pshf (memmove)
+    150,  // pscl (three 32 bit multiplications)
+     90,  // pfd
+      0   // pget
+};
+
+// Per pixel of a strip push, with the interrupts off: 24 bits of 20 cycles
+#define PROF_PUSH_PIXEL_CYCLES 480
+
+// Every tick: vm_step, the context loop and a dithered output_tick
+#define PROF_TICK_CYCLES 180
+// Every tick, per fading oreg: the fade step and its latch
+#define PROF_FADE_CYCLES 110
+
+static unsigned long      prof_cycles;  // In the current tick
+static unsigned long long cycles_sum;
+static unsigned long      cycles_max;
+static histogram_t        cycles_hist;
+
+void vm_profile_inst(byte op_byte){
+    prof_cycles += prof_inst_cycles[op_byte & 0x0f][op_byte >> 7];
+}
+
+void vm_profile_xop(byte data){
+  #if CFG_STRIP_PIXELS
+    byte xop = data >> 4;
+
+    if(xop >= VM_XOP_PFILL && xop <= VM_XOP_PGET) prof_cycles += (unsigned long)prof_pixel_cycles[xop - VM_XOP_PFILL] * CFG_STRIP_PIXELS;
+  #endif
+}
+#endif
+
+
+// Smallest value which at least a fraction p of the ticks don't exceed
+static unsigned long percentile(const histogram_t& hist, double p){
+    unsigned long total = 0, seen = 0;
+
+    for(histogram_t::const_iterator it = hist.begin();it != hist.end();++it) total += it->second;
+
+    for(histogram_t::const_iterator it = hist.begin();it != hist.end();++it){
+        seen += it->second;
+        if(seen >= p * total) return it->first;
+    }
+
+    return 0;
+}
+
+static void timer1_isr(){
+    envelope_tick(brightness);
+    output_tick(brightness.value >> 8);
+
+  #ifdef VM_PROFILE
+    prof_cycles = PROF_TICK_CYCLES;
+    for(byte i = 0;i < 3;i++){
+        if(lsp_vm.fade_left[i]) prof_cycles += PROF_FADE_CYCLES;
+    }
+  #endif
+
+    unsigned short insts = vm_step(lsp_vm, false);
+
+    inst_sum += insts;
+    if(insts > inst_max) inst_max = insts;
+    inst_hist[insts]++;
+
+  #if CFG_STRIP_PIXELS
+    // Like the firmware, at the end of the tick
+    bool pushed = strip_show(brightness.value >> 8);
+
+    #ifdef VM_PROFILE
+    if(pushed) prof_cycles += (unsigned long)PROF_PUSH_PIXEL_CYCLES * CFG_STRIP_PIXELS;
+    #endif
+
+    pushed = pushed && trace_strip;
+  #else
+    bool pushed = false;
+  #endif
+
+  #ifdef VM_PROFILE
+    cycles_sum += prof_cycles;
+    if(prof_cycles > cycles_max) cycles_max = prof_cycles;
+    cycles_hist[prof_cycles]++;
+  #endif
+
+    if(!quiet){
+        int pwm = (OCR0A << 16) | (OCR0B << 8) | OCR2A;
+
+        if(!only_changes || pwm != last_pwm || pushed){
+            fprintf(out, "%lu %u %u %u %u %u %u", tick,
+                OCR0A, OCR0B, OCR2A,
+                lsp_vm.outs.w[0], lsp_vm.outs.w[1], lsp_vm.outs.w[2]);
+
+          #if CFG_STRIP_PIXELS
+            if(pushed){
+                fputc(' ', out);
+                for(byte i = 0;i < CFG_STRIP_PIXELS;i++) fprintf(out, "%02x%02x%02x", strip_pixels[i][0], strip_pixels[i][1], strip_pixels[i][2]);
+            }
+          #endif
+
+            fputc('\n', out);
+        }
+
+        last_pwm = pwm;
+    }
+
+    tick++;
+}
+
+
+// Loads a .lspb into imem, returns its length
+static unsigned short load_program(const char* path, byte* imem){
+    FILE* pgm = fopen(path, "rb");
+    if(!pgm){
+        perror(path);
+        exit(1);
+    }
+
+    size_t imem_len = fread(imem, 1, MAX_PROG_LEN, pgm);
+    if(!imem_len){
+        fprintf(stderr, "Error: %s is empty\n", path);
+        exit(1);
+    }
+    if(fgetc(pgm) != EOF){
+        fprintf(stderr, "Error: %s is longer than %d bytes\n", path, MAX_PROG_LEN);
+        exit(1);
+    }
+    fclose(pgm);
+
+    return imem_len;
+}
+
+
+// Bytes the console receives to load and run the program over the audio link:
+// 'r', then 'w<byte>' for every byte (lspc's serial format), then 'P'
+static unsigned long upload_w_bytes(const byte* imem, unsigned short len){
+    unsigned long n = 2;
+
+    for(unsigned short i = 0;i < len;i++) n += imem[i] >= 100 ? 4 : imem[i] >= 10 ? 3 : 2;
+
+    return n;
+}
+
+// The same with a 'W' frame (len16, bytes, crc16), then 'P'
+static unsigned long upload_frame_bytes(unsigned short len){
+    return 1 + 2 + len + 2 + 1;
+}
+
+// Pulse distance modulation (see audio_rx.h), with the mean length of a byte
+static double upload_s(unsigned long bytes){
+    return bytes * (double)AUDIO_RX_BYTE_SAMPLES / AUDIO_RX_SAMPLE_RATE;
+}
+
+
+static double now_s(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char** argv){
+    unsigned long ticks = 10000;
+    unsigned int  bright = 255;
+    const char*   outpath = NULL;
+    bool          json = false;
+    int           builtin = -1;
+    unsigned int  ramp_ms = CFG_BRIGHTNESS_ADJ_MS, ramp_curve = CFG_BRIGHTNESS_CURVE;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:b:r:f:i:s:o:pcqjB:")) != -1){
+        switch(opt){
+            case 'n':
+                ticks = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'b':
+                bright = strtoul(optarg, NULL, 0);
+                if(bright > 255) usage();
+                break;
+
+            case 'r': {
+                ramp_req_t req;
+                unsigned int b;
+                if(sscanf(optarg, "%lu:%u", &req.tick, &b) != 2 || b > 255) usage();
+                req.bright = b;
+                ramp_reqs.push_back(req);
+                break;
+            }
+
+            case 'f':
+                if(sscanf(optarg, "%u:%u", &ramp_ms, &ramp_curve) != 2 || ramp_ms > 65535 || ramp_curve >= ENVELOPE_CURVES) usage();
+                break;
+
+            case 'i': {
+                irq_req_t req;
+                unsigned int v, a;
+                if(sscanf(optarg, "%lu:%u:%u", &req.tick, &v, &a) != 3 || v > 3 || a > 65535) usage();
+                req.vector = v;
+                req.arg    = a;
+                irq_reqs.push_back(req);
+                break;
+            }
+
+            case 's': {
+                switch_req_t req;
+                int path_off;
+                if(sscanf(optarg, "%lu:%n", &req.tick, &path_off) != 1 || !optarg[path_off]) usage();
+                req.path = optarg + path_off;
+                switch_reqs.push_back(req);
+                break;
+            }
+
+            case 'o':
+                outpath = optarg;
+                break;
+
+            case 'p':
+                if(!CFG_STRIP_PIXELS){
+                    fprintf(stderr, "Error: this build has no strip (CFG_STRIP_PIXELS)\n");
+                    return 1;
+                }
+                trace_strip = true;
+                break;
+
+            case 'c':
+                only_changes = true;
+                break;
+
+            case 'q':
+                quiet = true;
+                break;
+
+            case 'j':
+                json  = true;
+                quiet = true;
+                break;
+
+            case 'B':
+                builtin = strtoul(optarg, NULL, 0);
+                if(builtin >= vm_builtin_count()){
+                    fprintf(stderr, "Error: there's no built-in program %d\n", builtin);
+                    return 1;
+                }
+                break;
+
+            default:
+                usage();
+        }
+    }
+
+    if(optind != argc - (builtin < 0)) usage();
+
+    // lsp_imem[load_buf] is the buffer the console would write to
+    byte load_buf = 0;
+    unsigned short imem_len = 0;
+
+    // Of the first program
+    unsigned short prog_len;
+    unsigned long  upload_w = 0;
+
+    // A built-in program starts with a switch from an empty one, in the first tick
+    if(builtin < 0){
+        imem_len = load_program(argv[optind], lsp_imem[load_buf]);
+        upload_w = upload_w_bytes(lsp_imem[load_buf], imem_len);
+    } else {
+        switch_req_t req = {0, NULL, (unsigned int)builtin};
+        switch_reqs.insert(switch_reqs.begin(), req);
+    }
+
+    out = stdout;
+    if(outpath){
+        out = fopen(outpath, "w");
+        if(!out){
+            perror(outpath);
+            return 1;
+        }
+    }
+
+    envelope_init(brightness, bright << 8);
+    envelope_set_shape(brightness, ramp_ms, ramp_curve);
+    output_init(bright);
+
+  #if CFG_STRIP_PIXELS
+    strip_init();
+  #endif
+
+    unsigned short link_res = vm_reset(lsp_vm, lsp_imem[load_buf], imem_len);
+    if(link_res != VM_LINK_OK){
+        fprintf(stderr, "Error: %s failed the verification at 0x%04x\n", argv[optind], link_res);
+        return 1;
+    }
+
+    load_buf ^= 1;
+
+    prog_len = imem_len;
+
+    Timer1.initialize(1000);
+    Timer1.attachInterrupt(timer1_isr);
+
+    vm_set_pause(lsp_vm, false);
+
+    if(!quiet) fprintf(out, "# tick pwm_r pwm_g pwm_b out_r out_g out_b\n");
+
+    double t_start = now_s();
+
+    while(tick < ticks){
+        bool switch_pending = false;
+        bool switched       = false;
+
+        for(size_t i = 0;i < irq_reqs.size();i++){
+            if(irq_reqs[i].tick == tick) vm_request_interrupt(lsp_vm, irq_reqs[i].vector, irq_reqs[i].arg);
+        }
+
+        for(size_t i = 0;i < ramp_reqs.size();i++){
+            if(ramp_reqs[i].tick == tick) envelope_start(brightness, ramp_reqs[i].bright << 8);
+        }
+
+        for(size_t i = 0;i < switch_reqs.size();i++){
+            if(switch_reqs[i].tick > tick) switch_pending = true;
+            if(switch_reqs[i].tick != tick) continue;
+
+            if(!switch_reqs[i].path){
+                vm_switch_builtin(lsp_vm, switch_reqs[i].builtin);
+                switched = true;
+                continue;
+            }
+
+            imem_len = load_program(switch_reqs[i].path, lsp_imem[load_buf]);
+
+            // The switch happens inside a tick, run by the delay() in here
+            link_res = vm_switch_program(lsp_vm, lsp_imem[load_buf], imem_len);
+            if(link_res != VM_LINK_OK){
+                fprintf(stderr, "Error: %s failed the verification at 0x%04x\n", switch_reqs[i].path, link_res);
+                return 1;
+            }
+
+            load_buf ^= 1;
+            switched  = true;
+        }
+
+        if(!switched) Timer1.tick();
+
+        // hlt
+        if(lsp_vm.is_paused && !switch_pending) break;
+    }
+
+    double elapsed = now_s() - t_start;
+
+    if(out != stdout) fclose(out);
+
+    double inst_avg = tick ? (double)inst_sum / tick : 0.0;
+  #ifdef VM_PROFILE
+    double cycles_avg = tick ? (double)cycles_sum / tick : 0.0;
+  #endif
+
+    if(json){
+        // The program's name is its file's, without the extension
+        std::string name = "builtin " + std::to_string(builtin);
+        if(builtin < 0){
+            name = argv[optind];
+            name = name.substr(name.find_last_of('/') + 1);
+            name = name.substr(0, name.find_last_of('.'));
+        }
+
+        printf("{\"program\": \"%s\", \"bytes\": %u, \"ticks\": %lu, \"halted\": %s, ",
+            name.c_str(), prog_len, tick, lsp_vm.is_paused ? "true" : "false");
+        printf("\"insts_per_tick\": {\"mean\": %.3f, \"p99\": %lu, \"max\": %u}, \"preempted_ticks\": %u, ",
+            inst_avg, percentile(inst_hist, 0.99), inst_max, lsp_vm.preempt_cnt);
+      #ifdef VM_PROFILE
+        printf("\"avr_cycles_per_tick\": {\"mean\": %.1f, \"p99\": %lu, \"max\": %lu}, ",
+            cycles_avg, percentile(cycles_hist, 0.99), cycles_max);
+      #else
+        printf("\"avr_cycles_per_tick\": null, ");
+      #endif
+        printf("\"upload\": {\"bytes_per_s\": %.1f, \"w\": {\"bytes\": %lu, \"s\": %.3f}, \"frame\": {\"bytes\": %lu, \"s\": %.3f}}, ",
+            1 / upload_s(1), upload_w, upload_s(upload_w), upload_frame_bytes(prog_len), upload_s(upload_frame_bytes(prog_len)));
+        printf("\"host_ns_per_tick\": %.1f}\n", tick ? elapsed / tick * 1e9 : 0.0);
+
+        return 0;
+    }
+
+    fprintf(stderr, "%lu ticks (%.3f s simulated) in %.3f s, %.2f Mticks/s%s\n",
+        tick, tick / 1000.0, elapsed, elapsed > 0 ? tick / elapsed / 1e6 : 0.0,
+        lsp_vm.is_paused ? ", halted" : "");
+    fprintf(stderr, "instructions per tick: avg %.2f, p99 %lu, max %u, preempted ticks %u, irq queue overflows %u\n",
+        inst_avg, percentile(inst_hist, 0.99), inst_max, lsp_vm.preempt_cnt, lsp_vm.irq_overflow);
+  #ifdef VM_PROFILE
+    fprintf(stderr, "estimated avr cycles per tick: avg %.1f, p99 %lu, max %lu\n",
+        cycles_avg, percentile(cycles_hist, 0.99), cycles_max);
+  #endif
+
+    return 0;
+}
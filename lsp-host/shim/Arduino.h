@@ -0,0 +1,63 @@
+#ifndef LSP_HOST_ARDUINO_H
+#define LSP_HOST_ARDUINO_H 1
+
+/*
+    Minimal Arduino/AVR shim used to compile the lsp-avr sources on the host.
+    Only what the firmware modules actually touch is provided: the byte type,
+    the PWM compare registers, delay() and a Print-like Serial which writes
+    to stderr (so that it doesn't mix with the emulator's trace output)
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uint8_t byte;
+
+#define DEC 10
+#define HEX 16
+
+// Strings in flash
+#define F(s) (s)
+
+// Fake AVR registers
+extern volatile uint8_t OCR0A, OCR0B, OCR2A;
+
+void delay(unsigned long ms);
+
+// The host runs the "interrupts" in the same thread
+#define noInterrupts()
+#define interrupts()
+
+
+class HostSerial {
+    public:
+        void begin(unsigned long baud){ (void)baud; }
+
+        int  available(){ return 0; }
+        int  read(){ return -1; }
+
+        void print(const char* s){ fputs(s, stderr); }
+        void print(char c){ fputc(c, stderr); }
+        void print(unsigned char n, int base = DEC){ print((unsigned long)n, base); }
+        void print(int n, int base = DEC){ print((long)n, base); }
+        void print(unsigned int n, int base = DEC){ print((unsigned long)n, base); }
+        void print(short n, int base = DEC){ print((long)n, base); }
+        void print(unsigned short n, int base = DEC){ print((unsigned long)n, base); }
+        void print(signed char n, int base = DEC){ print((long)n, base); }
+        void print(long n, int base = DEC){
+            if(base == DEC) fprintf(stderr, "%ld", n);
+            else            fprintf(stderr, "%lX", (unsigned long)n);
+        }
+        void print(unsigned long n, int base = DEC){
+            fprintf(stderr, base == DEC ? "%lu" : "%lX", n);
+        }
+
+        void println(){ fputc('\n', stderr); }
+
+        template<typename T> void println(T v){ print(v); println(); }
+        template<typename T> void println(T v, int base){ print(v, base); println(); }
+};
+
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef LSP_HOST_TIMERONE_H
+#define LSP_HOST_TIMERONE_H 1
+
+// Host replacement of the TimerOne library: the period is ignored and
+// the attached callback is fired explicitly by calling tick()
+class TimerOne {
+    public:
+        void initialize(long microseconds){ period_us = microseconds; }
+        void attachInterrupt(void (*isr)()){ callback = isr; }
+
+        void tick(){ if(callback) callback(); }
+
+        long period_us = 1000;
+
+    private:
+        void (*callback)() = 0;
+};
+
+extern TimerOne Timer1;
+
+#endif
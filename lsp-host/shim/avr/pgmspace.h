@@ -0,0 +1,11 @@
+#ifndef LSP_HOST_PGMSPACE_H
+#define LSP_HOST_PGMSPACE_H 1
+
+// The host has no separate flash address space
+
+#define PROGMEM
+
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+
+#endif
@@ -0,0 +1,13 @@
+#include <Arduino.h>
+#include <TimerOne.h>
+
+volatile uint8_t OCR0A, OCR0B, OCR2A;
+
+HostSerial Serial;
+TimerOne   Timer1;
+
+// Time only passes in Timer1 ticks: the firmware delays while waiting for the
+// VM (pause acknowledge, program switch), which happens in the tick interrupt
+void delay(unsigned long ms){
+    while(ms--) Timer1.tick();
+}
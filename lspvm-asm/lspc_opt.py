@@ -0,0 +1,235 @@
+# -*- coding: utf-8 -*-
+#
+# Optional optimizer for lspc (-O), run on the parts before the addresses are computed.
+#
+# Every transformation keeps the state of the registers and of the outputs the same at
+# every tick boundary, so the per-tick trace doesn't change. The program only runs fewer
+# instructions to get there (which matters only if it relied on being preempted by the
+# VM's tick budget):
+#   - jump threading: a jump, drjnz, call or isetpc to a j goes to the j's destination,
+#     and a j to the next instruction is removed
+#   - dead code: code that no entry point (the start, ivec and context markers) reaches
+#     is removed. hlt, ret and iret fall through (the VM resumes after them), only j doesn't
+#   - folding: sr/so/mo overwritten or modified by the next sr/so/mo on the same register
+#     (with only sr/so/mo on other registers in between) are merged, mo of 0 is removed
+#   - commits: in a program without interrupt vectors, a cmt with no output register
+#     changed since the previous one in the same block is turned into a wt
+
+from lspc_types import *
+
+
+def _is_label(part):
+    return part.type == lsp_part_types_e.T_LABEL
+
+def _is_ref(part):
+    return part.type == lsp_part_types_e.T_ADDR_REF
+
+def _op(part):
+    return part.bytecode[0] & 0x0f if part.type == lsp_part_types_e.T_INST else None
+
+def _ro(part):
+    return (part.bytecode[0] >> 4) & 3
+
+def _is_entry(part):
+    # ivec and context markers
+    return _op(part) == 0b1001
+
+
+# sr/so/mo: value, as the VM sees it
+def _value(part):
+    bc = part.bytecode
+    isword = bc[0] >> 7
+
+    if _op(part) == 0b0001:
+        return bc[1] | (bc[2] << 8) if isword else bc[1]
+
+    if _op(part) == 0b0010:
+        return bc[1] | (bc[2] << 8) if isword else bc[1] << 8
+
+    val = bc[1] | (bc[2] << 8) if isword else bc[1]
+    sign = 0x8000 if isword else 0x80
+    return val - 2 * sign if val & sign else val
+
+def _encode(op, ro, val):
+    if op == 0b0010:
+        val &= 0xffff
+        if not val & 0xff:
+            return bytes([(ro << 4) | op, val >> 8])
+
+    elif op == 0b0011:
+        if -128 <= val <= 127:
+            return bytes([(ro << 4) | op, val & 0xff])
+
+    elif val <= 255:
+        return bytes([(ro << 4) | op, val])
+
+    return bytes([0b10000000 | (ro << 4) | op, val & 0xff, (val >> 8) & 0xff])
+
+# The register a sr/so/mo writes, None for other parts
+def _setmod_target(part):
+    op = _op(part)
+
+    if op == 0b0001:
+        return ("reg", _ro(part))
+
+    if op in (0b0010, 0b0011):
+        return ("oreg", _ro(part))
+
+    return None
+
+
+def _index(parts):
+    return {id(part): i for i, part in enumerate(parts)}
+
+# Index of the first part at or after i which isn't a label
+def _skip_labels(parts, i):
+    while i < len(parts) and _is_label(parts[i]):
+        i += 1
+    return i
+
+
+def _thread_jumps(parts):
+    changed = False
+    index = _index(parts)
+
+    for part in parts:
+        if not _is_ref(part):
+            continue
+
+        seen = {id(part)}
+
+        while True:
+            i = _skip_labels(parts, index[id(part.dst)])
+            if i == len(parts):
+                break
+
+            tgt = parts[i]
+            if not _is_ref(tgt) or tgt.inst != "j" or id(tgt) in seen:
+                break
+
+            seen.add(id(tgt))
+            part.dst = tgt.dst
+            changed = True
+
+    # j to the next instruction
+    i = 0
+    while i < len(parts):
+        part = parts[i]
+
+        if _is_ref(part) and part.inst == "j" and index[id(part.dst)] > i and _skip_labels(parts, i + 1) >= index[id(part.dst)]:
+            del parts[i]
+            index = _index(parts)
+            changed = True
+            continue
+
+        i += 1
+
+    return changed
+
+
+def _remove_dead_code(parts):
+    index = _index(parts)
+    todo  = [0] + [i for i, part in enumerate(parts) if _is_entry(part)]
+    seen  = set()
+
+    while todo:
+        i = todo.pop()
+
+        while i < len(parts) and i not in seen:
+            seen.add(i)
+            part = parts[i]
+
+            if _is_ref(part):
+                todo.append(index[id(part.dst)])
+
+                if part.inst == "j":
+                    break
+
+            i += 1
+
+    if len(seen) == len(parts):
+        return False
+
+    parts[:] = [part for i, part in enumerate(parts) if i in seen]
+    return True
+
+
+def _fold(parts):
+    changed = False
+
+    i = 0
+    while i < len(parts):
+        first  = parts[i]
+        target = _setmod_target(first)
+
+        if target is None:
+            i += 1
+            continue
+
+        if _op(first) == 0b0011 and _value(first) == 0:
+            del parts[i]
+            changed = True
+            continue
+
+        # The next sr/so/mo on the same register, if only sr/so/mo on others come before it
+        j = i + 1
+        while j < len(parts) and _setmod_target(parts[j]) not in (None, target):
+            j += 1
+
+        if j == len(parts) or _setmod_target(parts[j]) != target:
+            i += 1
+            continue
+
+        second = parts[j]
+
+        if _op(second) == 0b0011:
+            if _op(first) == 0b0010:
+                second.bytecode = _encode(0b0010, _ro(first), _value(first) + _value(second))
+            else:
+                total = (_value(first) + _value(second) + 0x8000) % 0x10000 - 0x8000
+                second.bytecode = _encode(0b0011, _ro(first), total)
+
+        del parts[i]
+        changed = True
+
+    return changed
+
+
+def _relax_commits(parts):
+    if any(_is_entry(part) and not part.bytecode[0] & 0b01000000 for part in parts):
+        return False
+
+    changed = False
+    dirty   = True
+
+    for part in parts:
+        op = _op(part)
+
+        if op is None or _is_entry(part) or op == 0b0000:
+            dirty = True
+
+        elif op == 0b0100:
+            if not dirty:
+                part.bytecode = bytes([0b0101])
+                changed = True
+            dirty = False
+
+        elif op in (0b0010, 0b0011) or (op == 0b1100 and _ro(part) != 3):
+            dirty = True
+
+        # xop: SETOUT, MODOUT, and the pixel operations (pget sets the oregs, the others change the frame cmt pushes)
+        elif op == 0b1111 and (part.bytecode[1] >> 4 in (3, 5) or part.bytecode[1] >> 4 >= 8):
+            dirty = True
+
+    return changed
+
+
+def optimize(parts):
+    while True:
+        changed  = _thread_jumps(parts)
+        changed |= _remove_dead_code(parts)
+        changed |= _fold(parts)
+        changed |= _relax_commits(parts)
+
+        if not changed:
+            return parts
@@ -0,0 +1,168 @@
+# -*- coding: utf-8 -*-
+#
+# Compressed program images (lspc -z), for the firmware built with CFG_VM_COMPRESSED (see
+# the decoder in lsp-avr/vm.cpp, which must match this file).
+#
+# The image is:
+#   u16            length of the bytecode (the program's address space), little endian
+#   u16 * (n - 1)  image offsets of the blocks 1 to n - 1 (block 0 follows the table)
+#   blocks         the bytecode in blocks of BLOCK_LEN bytes (the last one can be shorter),
+#                  each compressed on its own, so the VM can decode any of them on a fetch
+# A block is a sequence of
+#   0nnnnnnn                  n + 1 literal bytes follow
+#   10nnnnnn <d>              n + 3 bytes copied from d + 1 bytes back
+#   11nnnnnh <l>              n + 3 bytes copied from the image, at offset (h << 8) | l
+# where "back" goes through the block decoded so far and then through DICT, which the
+# decoder places right before every block: it holds the instruction sequences most programs
+# start with (the outputs cleared or set to full, a commit, the usual waits), so that even
+# the small programs, without repetitions of their own, get a bit shorter.
+# The copies from the image reach the literals of the other blocks (the ones before, as
+# lspc emits them), which is where most of the repetitions of a longer program are: they
+# are stored once, and the blocks still decode on their own.
+
+BLOCK_LEN = 64
+
+# Max length of the bytecode in an image, VM_Z_MAX_LEN in lsp-avr/vm.h
+MAX_LEN = 1024
+
+# Max length of an image, MAX_PROG_LEN
+MAX_IMAGE_LEN = 512
+
+DICT = bytes([
+    0x02, 0x00, 0x12, 0x00, 0x22, 0xff, 0x04,  # so @R, 0 / so @G, 0 / so @B, 255 / cmt
+    0x02, 0xff, 0x12, 0xff, 0x22, 0xff, 0x04,  # so @R, 255 / so @G, 255 / so @B, 255 / cmt
+    0x02, 0x00, 0x12, 0x00, 0x22, 0x00,        # so @R, 0 / so @G, 0 / so @B, 0
+    0x04, 0x81, 0x88, 0x13, 0x03,              # cmt / sr %A, 5000 / mo ...
+    0x8d, 0xc8, 0x00,                          # wtn 200
+    0x07,                                      # j ...
+])
+
+MIN_MATCH      = 3
+MAX_MATCH      = 0x3f + MIN_MATCH
+MAX_IMAGE_COPY = 0x1f + MIN_MATCH
+MAX_DIST       = 256
+MAX_RUN        = 0x80
+
+
+def _longest(data, pos, starts, limit):
+    # The longest match of data[pos:] in data at one of starts: (length, start)
+    best = (0, 0)
+
+    for start in starts:
+        n = 0
+        while pos + n < len(data) and n < limit and data[start + n] == data[pos + n]:
+            n += 1
+
+        if n > best[0]:
+            best = (n, start)
+
+    return best
+
+# Appends the compressed block to image, which holds the blocks before it from table_len on
+def _compress_block(block, image, table_len):
+    run = bytearray()
+
+    def flush():
+        if run:
+            image.append(len(run) - 1)
+            image.extend(run)
+            run.clear()
+
+    # The window: the dictionary, then the block
+    data = DICT + block
+    pos  = len(DICT)
+
+    while pos < len(data):
+        match_len, match_start = _longest(data, pos, range(pos - 1, max(0, pos - MAX_DIST) - 1, -1), MAX_MATCH)
+
+        # Only the bytes before the pending literals, which can move
+        copy_len, copy_start = _longest(bytes(image) + data[pos:], len(image), range(table_len, len(image)), MAX_IMAGE_COPY)
+        copy_len = min(copy_len, len(image) - copy_start)
+
+        if match_len >= MIN_MATCH and match_len >= copy_len:
+            flush()
+            image += bytes([0x80 | (match_len - MIN_MATCH), pos - match_start - 1])
+            pos += match_len
+        elif copy_len >= MIN_MATCH and copy_start < MAX_IMAGE_LEN:
+            flush()
+            image += bytes([0xc0 | ((copy_len - MIN_MATCH) << 1) | (copy_start >> 8), copy_start & 0xff])
+            pos += copy_len
+        else:
+            run.append(data[pos])
+            pos += 1
+
+            if len(run) == MAX_RUN:
+                flush()
+
+    flush()
+
+
+def compress(bytecode):
+    if len(bytecode) > MAX_LEN:
+        raise ValueError(f"the program is longer than {MAX_LEN} bytes")
+
+    nblocks   = (len(bytecode) + BLOCK_LEN - 1) // BLOCK_LEN
+    table_len = 2 + 2 * max(nblocks - 1, 0)
+
+    image = bytearray(len(bytecode).to_bytes(2, "little")) + bytes(table_len - 2)
+
+    for b in range(nblocks):
+        if b:
+            image[2 * b:2 * b + 2] = len(image).to_bytes(2, "little")
+
+        _compress_block(bytecode[b * BLOCK_LEN:(b + 1) * BLOCK_LEN], image, table_len)
+
+    if len(image) > MAX_IMAGE_LEN:
+        raise ValueError(f"the compressed image is longer than {MAX_IMAGE_LEN} bytes ({len(image)})")
+
+    return bytes(image)
+
+
+def decompress(image):
+    if len(image) < 2:
+        raise ValueError("the image is too short")
+
+    length  = int.from_bytes(image[:2], "little")
+    nblocks = (length + BLOCK_LEN - 1) // BLOCK_LEN
+    starts  = [2 + 2 * max(nblocks - 1, 0)] + [int.from_bytes(image[2 + 2 * i:4 + 2 * i], "little") for i in range(nblocks - 1)]
+    ends    = starts[1:] + [len(image)]
+
+    bytecode = bytearray()
+
+    for b in range(nblocks):
+        want = min(BLOCK_LEN, length - b * BLOCK_LEN)
+        data = bytearray(DICT)
+        i, end = starts[b], ends[b]
+
+        while i < end:
+            c = image[i]
+            i += 1
+
+            if c < 0x80:
+                data += image[i:i + c + 1]
+                i += c + 1
+            elif c < 0xc0:
+                dist = image[i] + 1
+                i += 1
+
+                if dist > len(data):
+                    raise ValueError(f"bad distance in block {b}")
+
+                for _ in range((c & 0x3f) + MIN_MATCH):
+                    data.append(data[-dist])
+            else:
+                n   = ((c >> 1) & 0x1f) + MIN_MATCH
+                off = ((c & 1) << 8) | image[i]
+                i += 1
+
+                if off + n > len(image):
+                    raise ValueError(f"bad image copy in block {b}")
+
+                data += image[off:off + n]
+
+        if len(data) - len(DICT) != want or i != end:
+            raise ValueError(f"bad block {b}")
+
+        bytecode += data[len(DICT):]
+
+    return bytes(bytecode)
@@ -65,40 +65,42 @@ ivector 0:
 
 # warning led, arg: repetitions
 ivector 1:
-    sob @R, 0
-    sob @G, 0
-    sob @B, 0
-    cmt
+    sr %C, 0
+    call _i1_gray
 
   _i1_repeat:
   
     sr %B, 250
-  _i1_to_white:
-    mo @R, 261
-    mo @G, 261
-    mo @B, 261
-    cmt
-    drjnz %B, _i1_to_white
+    sr %D, 261
+    call _i1_ramp
 
-    sob @R, 255
-    sob @G, 255
-    sob @B, 255
-    cmt
+    sr %C, 65280
+    call _i1_gray
 
     sr %B, 250
-  _i1_to_black:
-    mo @R, -261
-    mo @G, -261
-    mo @B, -261
-    cmt
-    drjnz %B, _i1_to_black
+    sr %D, 65275
+    call _i1_ramp
 
-    sob @R, 0
-    sob @G, 0
-    sob @B, 0
-    cmt
+    sr %C, 0
+    call _i1_gray
 
     drjnz %A, _i1_repeat
 
     iret
 
+  # sets every output to %C
+  _i1_gray:
+    mv @R, %C
+    mv @G, %C
+    mv @B, %C
+    cmt
+    ret
+
+  # adds %D (65275 is -261) to every output, %B times
+  _i1_ramp:
+    add @R, %D
+    add @G, %D
+    add @B, %D
+    cmt
+    drjnz %B, _i1_ramp
+    ret
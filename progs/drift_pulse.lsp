@@ -0,0 +1,34 @@
+# Context 0: slow R <-> G hue drift, 10 s per direction
+drift:
+    sob @R, 255
+    sob @G, 0
+    cmt
+
+  _dr_start:
+    sr %A, 10000
+  _dr_to_green:
+    mo @R, -6
+    mo @G,  6
+    cmt
+    drjnz %A, _dr_to_green
+
+    sr %A, 10000
+  _dr_to_red:
+    mo @R,  6
+    mo @G, -6
+    cmt
+    drjnz %A, _dr_to_red
+
+    j _dr_start
+
+
+
+# Context 1: B pulses twice a second, independently from the drift
+context 1 @B:
+  _pl_loop:
+    fdb @B, 255, 150
+    fwt
+    fdb @B, 0, 150
+    fwt
+    wtnw 200
+    j _pl_loop
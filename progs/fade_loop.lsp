@@ -0,0 +1,21 @@
+# color_loop with fades: R -> G -> B, 5 s each
+fade_loop:
+    sob @R, 0
+    sob @G, 0
+    sob @B, 255
+    cmt
+
+  _fl_start:
+    fdb @R, 255, 5000
+    fdb @B, 0,   5000
+    fwt
+
+    fdb @R, 0,   5000
+    fdb @G, 255, 5000
+    fwt
+
+    fdb @G, 0,   5000
+    fdb @B, 255, 5000
+    fwt
+
+    j _fl_start
@@ -0,0 +1,59 @@
+# Addressable strip (CFG_STRIP_PIXELS): a red to blue gradient which rotates along the
+# strip for 10 s, then three comets with a fading tail. The pixel indices past the end
+# of the strip are clamped to the last pixel, so it runs on any length
+start:
+    # The gradient from the first pixel (%C) to the last one (%D)
+    sr %C, 0
+    sr %D, 255
+    sob @R, 255
+    sob @G, 0
+    sob @B, 0
+    pfill %C, %C
+    sob @R, 0
+    sob @B, 255
+    pfill %D, %D
+    pgrad %C, %D
+    cmt
+
+    # A pixel every 20 ms
+    sr %B, 1
+    sr %A, 500
+  _rotate:
+    prot %B
+    cmt
+    wtn 19
+    drjnz %A, _rotate
+
+    # Clear, then the comets fade the whole strip by 40/256 every step
+    sob @R, 0
+    sob @G, 0
+    sob @B, 0
+    sr %B, 0
+    pfill %B, %D
+    sr %C, 1
+    sr %D, 40
+
+    call _comet
+    call _comet
+    call _comet
+    j start
+
+
+# %B is the head, which stops on the last pixel while the tail fades out
+_comet:
+    sr %B, 0
+    sr %A, 48
+  _comet_step:
+    sob @R, 0
+    sob @G, 0
+    sob @B, 0
+    pfd %D
+    sob @R, 255
+    sob @G, 160
+    sob @B, 64
+    pfill %B, %B
+    cmt
+    wtn 29
+    add %B, %C
+    drjnz %A, _comet_step
+    ret